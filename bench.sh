@@ -0,0 +1,175 @@
+#!/bin/sh
+# SPDX-License-Identifier: MIT-0
+# bench.sh
+# Copyright (C) 2025 Casey Fitzpatrick <kcghost@gmail.com>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+# Time gpt against synthetic images in regular files, no root needed
+set -e
+
+GPT="${GPT:-./gpt}"
+# timed runs of each operation
+RUNS="${RUNS:-20}"
+# "lbsz entries entry_size full|sparse" per image
+CONFIGS="${CONFIGS:-512 128 128 full
+512 128 128 sparse
+4096 128 128 full
+512 1024 128 full
+512 128 256 full
+4096 1024 512 sparse
+512 8192 128 sparse
+512 8192 128 full
+4096 8064 128 full}"
+# blocks per generated partition
+PART_BLOCKS=8
+# -s commands per -s burst
+BURST=32
+
+onerr() {
+	code=$?
+	rm -rf "${work}"
+	[ ${code} -eq 0 ] && exit
+	echo "Failure occurred!"
+}
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/gpt-bench.XXXXXX")
+trap 'onerr' EXIT
+
+# slot numbers are 1 based, each slot gets its own fixed range so any subset fits
+# set_args <first usable> <from slot> <to slot> <step>
+set_args() {
+	awk -v first="${1}" -v from="${2}" -v to="${3}" -v step="${4}" -v pb="${PART_BLOCKS}" 'BEGIN {
+		for(i = from; i <= to; i += step) {
+			s = first + (i - 1) * pb
+			printf " -s %u s=%u e=%u", i, s, s + pb - 1
+		}
+	}'
+}
+
+# make_image <file> <lbsz> <entries> <entry size> <full|sparse>
+# sets img_geo and img_first for the commands that follow
+make_image() {
+	img="${1}"
+	lbsz="${2}"
+	entries="${3}"
+	esz="${4}"
+	table_blocks=$(( (entries * esz + lbsz - 1) / lbsz ))
+	img_first=$(( 2 + table_blocks ))
+	# partitions, then the backup table, then the backup header
+	last_lb=$(( img_first + (entries * PART_BLOCKS) + table_blocks ))
+	img_geo="-L ${lbsz} -B ${last_lb}"
+
+	rm -f "${img}"
+	truncate -s "$(( (last_lb + 1) * lbsz ))" "${img}"
+	# shellcheck disable=SC2086
+	"${GPT}" "${img}" ${img_geo} -N "${entries}" -R 92 "${esz}" -g >/dev/null 2>&1
+
+	step=1
+	if [ "${5}" = "sparse" ]; then
+		step=64
+	fi
+	# staged in chunks to keep command lines reasonable
+	from=1
+	while [ "${from}" -le "${entries}" ]; do
+		to=$(( from + (512 * step) - 1 ))
+		# shellcheck disable=SC2046
+		"${GPT}" "${img}" ${img_geo} -S $(set_args "${img_first}" "${from}" "$(( to < entries ? to : entries ))" "${step}") >/dev/null 2>&1
+		from=$(( to + 1 ))
+	done
+}
+
+# count every syscall and sum bytes moved by read/write variants in an strace -f log
+trace_totals() {
+	awk '
+		/^[0-9]+ +(\+\+\+|---)/ { next }
+		!/resumed>/ { calls++ }
+		/(^|[ <.])(read|pread64|readv|preadv|preadv2|write|pwrite64|writev|pwritev|pwritev2)[( ]/ && / = [0-9]+/ && !/unfinished/ {
+			for(i = NF; i > 0; i--) {
+				if($i == "=") { bytes += $(i + 1); break }
+			}
+		}
+		END { printf "%u %u\n", calls, bytes }
+	' "${1}"
+}
+
+# measure <name> <command...>
+# every operation is idempotent on the image so runs can repeat without a fresh copy
+measure() {
+	name="${1}"; shift
+	i=0
+	start=$(date +%s%N)
+	while [ "${i}" -lt "${RUNS}" ]; do
+		"$@" >/dev/null 2>&1
+		i=$(( i + 1 ))
+	done
+	end=$(date +%s%N)
+
+	calls="-"
+	bytes="-"
+	if [ "${have_strace}" = "1" ]; then
+		strace -f -qq -o "${work}/trace" "$@" >/dev/null 2>&1
+		read -r calls bytes << EOF
+$(trace_totals "${work}/trace")
+EOF
+	fi
+
+	awk -v cfg="${cfg_name}" -v name="${name}" -v runs="${RUNS}" -v ns="$(( end - start ))" -v bytes="${bytes}" -v calls="${calls}" 'BEGIN {
+		printf "%-22s %-9s %10.1f %12s %9s\n", cfg, name, runs / (ns / 1e9), bytes, calls
+	}'
+}
+
+bench_config() {
+	lbsz="${1}"
+	entries="${2}"
+	esz="${3}"
+	fill="${4}"
+	cfg_name="L${lbsz} N${entries} R${esz} ${fill}"
+	img="${work}/disk.img"
+
+	make_image "${img}" "${lbsz}" "${entries}" "${esz}" "${fill}"
+
+	burst=$(( entries < BURST ? entries : BURST ))
+	# shellcheck disable=SC2086
+	set -- ${img_geo}
+	measure "print" "${GPT}" "${img}" "$@" -p
+	measure "json" "${GPT}" "${img}" "$@" -F json -p
+	# shellcheck disable=SC2046
+	measure "set-x${burst}" "${GPT}" "${img}" "$@" $(set_args "${img_first}" 1 "${burst}" 1)
+	# shellcheck disable=SC2046
+	measure "staged" "${GPT}" "${img}" "$@" -S $(set_args "${img_first}" 1 "${burst}" 1)
+	measure "restore-f" "${GPT}" "${img}" "$@" -f
+	measure "restore-l" "${GPT}" "${img}" "$@" -l
+	measure "build-g" "${GPT}" "${img}" "$@" -N "${entries}" -R 92 "${esz}" -g
+}
+
+main() {
+	[ -x "${GPT}" ] || { echo "need ${GPT}, run make first" >&2; exit 1; }
+	have_strace="0"
+	if command -v strace >/dev/null; then
+		have_strace="1"
+	else
+		echo "strace not found, bytes and syscalls per op will not be reported" >&2
+	fi
+
+	printf "%-22s %-9s %10s %12s %9s\n" "config" "op" "ops/sec" "bytes/op" "calls/op"
+	echo "${CONFIGS}" | while read -r config; do
+		# shellcheck disable=SC2086
+		bench_config ${config}
+	done
+}
+
+main "${@}"
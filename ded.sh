@@ -27,6 +27,10 @@ set -e
 NORMAL_PRECISION="4"
 # max that doesn't cause errors comparing large numbers
 MAX_PRECISION="18"
+# used for moving partition data
+GPT="${GPT:-gpt}"
+# interrupted moves resume from checkpoints kept here, it must survive a reboot
+JOURNAL_DIR="${JOURNAL_DIR:-/var/tmp}"
 
 onerr() {
 	code=$?
@@ -215,11 +219,27 @@ parse_bytes() {
 disk_hook() { :; }
 part_hook() { :; }
 
+# parted is only asked once per device for its layout, until something changes it
+# load_layout <device>
+load_layout() {
+	if [ "${layout_device}" = "${1}" ]; then
+		return
+	fi
+	if [ ! -r "${1}" ]; then
+		fail "Cannot not read from ${1}!"
+	fi
+	layout=$(parted -ms "${1}" unit B print free) || fail "Could not read from device"
+	layout_device="${1}"
+}
+
+# call after anything that changes the table or a filesystem on it
+invalidate_layout() {
+	layout_device=""
+}
+
 parse_device() {
 	device="${1}"
-	if [ ! -r "${device}" ]; then
-		fail "Cannot not read from ${device}!"
-	fi
+	load_layout "${device}"
 	free_i="0"
 	while read -r line; do
 		if [ "${line}" = "BYT;" ]; then
@@ -242,7 +262,7 @@ parse_device() {
 		fi
 		part_hook
 	done << EOF
-$(parted -ms "${device}" unit B print free || fail "Could not read from device")
+${layout}
 EOF
 }
 
@@ -271,6 +291,8 @@ print_device() {
 	printf "\n"
 }
 
+# the parted -lm listing can't fill the layout cache, it has no free space rows and isn't in bytes
+# every device is still read by parted only once here, and ded exits right after
 printall() {
 	get_blockdevs
 	if [ "${block_devices}" = "" ]; then
@@ -439,6 +461,7 @@ create_cmd() {
 	
 	sync
 	partprobe
+	invalidate_layout
 	get_part "${target_start}"
 	get_partdevice "${device}" "${r_part}"
 	printf "The next operation will format new partition %s on block device %s.\n" "${r_part}" "${r_partdevice}"
@@ -466,6 +489,7 @@ create_cmd() {
 
 	sync
 	partprobe
+	invalidate_layout
 	print_device "${device}"
 
 	echo "Success!"
@@ -510,6 +534,8 @@ resize_cmd() {
 	target_fs="${r_fs}"
 	current_end="${r_end}"
 	current_size="${r_size}"
+	# parse_diskline ran as part of get_section
+	lbsz="${p_sector_logical}"
 	get_partdevice "${device}" "${target_num}"
 
 	# get next section details
@@ -538,6 +564,7 @@ resize_cmd() {
 		partprobe
 		# TODO: undo partition change on fail
 		resize_fs "${r_partdevice}" "${target_fs}" "${wanted_size}"
+		invalidate_layout
 		
 		print_device "${device}"
 	elif [ "${current_size}" -gt "${wanted_size}" ]; then
@@ -546,10 +573,11 @@ resize_cmd() {
 		confirm
 
 		resize_fs "${r_partdevice}" "${target_fs}" "${wanted_size}"
-		# parted -s doesn't work for shrinking partitions "to be safe"
-		# use undocumented option "---pretend-input-tty" to work around with "yes"
-		# could also work around by removing and re-creating?
-		yes 2>/dev/null | parted ---pretend-input-tty "${device}" unit B resizepart "${target_num}" "${target_end}" || fail "Failed to resize partition!"
+		# parted -s refuses to shrink partitions "to be safe", gpt just moves the end of the entry
+		assert_exists "${GPT}"
+		"${GPT}" "${device}" -E "${target_num}" - "$(( (target_end + 1) / lbsz - 1 ))" || fail "Failed to resize partition!"
+		partprobe "${device}"
+		invalidate_layout
 		print_device "${device}"
 	else
 		fail "Partition ${target_num} is already that size!"
@@ -567,6 +595,7 @@ rm_cmd() {
 	confirm
 
 	parted -s "${device}" rm "${target_num}" || fail "Failed to remove partition ${target_num}"
+	invalidate_layout
 
 	print_device "${device}"
 	echo "Success!"
@@ -578,53 +607,41 @@ lshift_cmd() {
 	get_section "${from}"
 	from_start="${r_start}"
 	from_size="${r_size}"
-	from_fs="${r_fs}"
-	from_name="${r_name}"
-	from_flags="${r_flags}"
-	in_mib=$(( from_size / 1024 / 1024 ))
+	# parse_diskline ran as part of get_section
+	lbsz="${p_sector_logical}"
 	
 	get_part "$(( r_start - 1 ))"
 	to="${r_part}"
 	get_section "${to}"
 	to_start="${r_start}"
 	to_type="${r_type}"
-	new_end=$(( to_start + from_size - 1 ))
 
 	if [ "${to_type}" != "free" ]; then
 		fail "Must be shifted into free space!"
 	fi
 
 	print_device "${device}"
-	printf "The next operation will move partition %s data to %s and re-create the partition.\n" "${from}" "${to}"
-	# TODO: move partition without re-creating it
-	printf "WARNING: The partition may get a new number. (The partition table entry will be re-created.)\n"
+	printf "The next operation will move partition %s data to %s and then move its table entry.\n" "${from}" "${to}"
 	printf "WARNING: This is the sketchiest possible thing you could do. Backup anything important!\n"
 	confirm
 
+	assert_exists "${GPT}"
+	# the table isn't touched until the copy is done, so a re-run finds the same move and resumes it
+	journal="${JOURNAL_DIR}/ded-lshift-${device##*/}-${from_start}-${to_start}"
 	printf "Copying data... (may take awhile!)\n"
-	dd \
-	conv=fsync,notrunc \
-	bs=1048576 \
-	iflag=skip_bytes,fullblock \
-	oflag=seek_bytes \
-	"seek=${to_start}" \
-	"skip=${from_start}" \
-	"count=${in_mib}" \
-	"if=${device}" \
-	"of=${device}" || fail "Failed to copy partition data!"
-
-	# parted doesn't support resizing "to the left" afaik. Remove and recreate partition
-	parted -s "${device}" rm "${from}" || fail "Failed to remove existing partition!"
-	parted -s "${device}" unit B mkpart \""${from_name}"\" "${from_fs}" "${to_start}" "${new_end}" || fail "Failed to re-create partition!"
-	# """
-	get_part "${to_start}"
-	OIFS="${IFS}"
-	IFS=' ,'
-	# shellcheck disable=SC2086
-	for flag in ${from_flags}; do
-		parted -s "${device}" set "${r_part}" "${flag}" on || fail "Failed to set flag on new partition!"
-	done
-	IFS="${OIFS}"
+	if [ -e "${journal}" ]; then
+		printf "Found %s, resuming the interrupted copy.\n" "${journal}"
+	fi
+	# overlap safe, synced before it returns, and only what the filesystem uses is moved
+	"${GPT}" "${device}" -A -J "${journal}" -D \
+	"$(( from_start / lbsz ))" \
+	"$(( to_start / lbsz ))" \
+	"$(( from_size / lbsz ))" || fail "Failed to copy partition data!"
+
+	# one table write, the entry keeps its number, ids, flags and name
+	"${GPT}" "${device}" -E "${from}" "$(( to_start / lbsz ))" - || fail "Failed to move partition entry!"
+	partprobe "${device}"
+	invalidate_layout
 
 	print_device "${device}"
 	echo "Success!"
@@ -635,6 +652,7 @@ wipe_cmd() {
 	printf "WARNING! The next operation will destroy all partitions on %s!\n" "${device}"
 	confirm
 	parted -s "${device}" mktable gpt || fail "Failed to create GPT table!"
+	invalidate_layout
 
 	print_device "${device}"
 	echo "Success!"
@@ -674,7 +692,7 @@ If NAME is not provided a generic default name will be used according to TYPE.
 The same NAME is used to label both the partition and filesystem if supported.
 
 Required external commands for full functionality:
-parted
+parted, gpt
 resize2fs, fatresize, ntfsresize
 mkfs.ext4, mkfs.vfat, mkfs.ntfs
 EOF
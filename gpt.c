@@ -20,34 +20,73 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <uchar.h>
 #include <wchar.h>
 #include <locale.h>
 #include <limits.h>
+#include <setjmp.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/random.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <pthread.h>
 #include <linux/fs.h>
 #include <linux/hdreg.h>
+#include <linux/io_uring.h>
+#include <linux/netlink.h>
 
 #ifndef BLKGETDISKSEQ
 #define BLKGETDISKSEQ _IOR(0x12,128,__u64)
 #endif
 
 char* program_name = "gpt";
-int first_print = 1;
+__thread int first_print = 1;
+// print streams, redirected per thread while scanning devices concurrently
+__thread FILE* tout;
+__thread FILE* terr;
+#define OUT (tout ? tout : stdout)
+#define ERR (terr ? terr : stderr)
+// set while a scan worker runs a job, fail() then ends that job instead of the whole sweep
+__thread jmp_buf* fail_jmp;
+// -F: text is for people, json and bin are for collectors
+enum { FORMAT_TEXT, FORMAT_JSON, FORMAT_BIN };
+int out_format = FORMAT_TEXT;
+// -K: where validated tables are kept between runs, NULL to always validate
+char* cache_dir = NULL;
 #define MBR_SZ 512
 // minimal size without extra reserved space (that must be zero in current spec)
 #define HDR_SZ  92
 #define PART_SZ 128
 // semi-arbitrary size for buffered read/write
 #define BLOCK_SZ 512
+// largest buffer for checking or writing that a range of the device is zero
+#define ZERO_CHUNK (1024 * 1024)
+// blank table runs at least this long are zeroed in place rather than written
+#define ZERO_MIN (16 * 1024)
+// concurrent device probes when printing all devices
+#define SCAN_WORKERS 8
+// default seconds to wait on a single device when printing all devices
+#define SCAN_TIMEOUT 10
+// data copies (-D) go in chunks this big, with this many in flight
+#define COPY_CHUNK (4 * 1024 * 1024)
+#define COPY_WORKERS 4
+// seconds between progress reports during a data copy
+#define COPY_REPORT 5
 // 12 digits can represent 1 PiB in 4096 blocks
 #define BLOCKS_DIGITS 12
 // longest known type alias "root-loongarch64-verity-sig"
@@ -130,9 +169,91 @@ typedef struct {
 	part_entry e;
 } mpart;
 
+// -F bin: every record is REC_SZ bytes, little endian, unused bytes are zero
+#define REC_SZ 160
+typedef struct __attribute__((__packed__)) {
+	uint8_t  head;
+	uint8_t  sector;
+	uint16_t cylinder;
+} rec_chs;
+
+typedef struct __attribute__((__packed__)) {
+	// 'd' device, 'm' mbr partition, 'p' gpt partition, 'f' free range, 'e' watch event
+	char     kind;
+	uint8_t  reserved[3];
+	uint32_t num;
+	union {
+		struct __attribute__((__packed__)) {
+			uint64_t seq;
+			uint64_t first_lba;
+			uint64_t last_lba;
+			uint64_t last_lb;
+			uint32_t entries;
+			uint32_t lbsz;
+			uint8_t  heads;
+			uint8_t  sectors;
+			uint16_t cylinders;
+			uint32_t boot_crc;
+			uint16_t unknown;
+			uint32_t unique_sig;
+			uint8_t  valid_gpt;
+			uint8_t  reserved;
+			uint8_t  disk_guid[16];
+			// truncated if longer, null terminated otherwise
+			char     path[80];
+		} d;
+		struct __attribute__((__packed__)) {
+			uint32_t start_lba;
+			uint32_t size_lba;
+			rec_chs  start;
+			rec_chs  end;
+			uint8_t  type;
+		} m;
+		part_entry p;
+		struct __attribute__((__packed__)) {
+			uint64_t start_lba;
+			uint64_t end_lba;
+		} f;
+		struct __attribute__((__packed__)) {
+			uint64_t seq;
+			// check_device result, 0 is a valid table
+			int32_t  status;
+			// null terminated
+			char     event[8];
+			char     path[80];
+		} e;
+		uint8_t raw[REC_SZ - 8];
+	};
+} rec;
+_Static_assert(sizeof(rec) == REC_SZ, "bad rec size!");
+
+// all of one device's records, written out at once
+typedef struct {
+	char* data;
+	size_t len;
+	size_t cap;
+} rec_buf;
+
+// a write held by the in-memory backend
+typedef struct {
+	off_t offset;
+	size_t len;
+	uint8_t* data;
+} mem_extent;
+
 typedef struct {
 	char device[PATH_MAX];
 	int fd;
+	// -I: block I/O backend, and state for the mmap and memory backends
+	const struct io_ops* io;
+	uint8_t* map;
+	uint64_t map_sz;
+	int map_writable;
+	mem_extent* mem;
+	size_t mem_count;
+	struct io_ring* ring;
+	// held writes and the ring are shared, everything else a backend does is positional
+	pthread_mutex_t io_lock;
 	unsigned int lbsz;
 	uint64_t last_lba;
 	struct hd_geometry geo;
@@ -147,16 +268,36 @@ typedef struct {
 	int part_entries;
 	int padding[4];
 	int max_entries;
+	// -J: checkpoint file for data copies (-D)
+	char* journal;
+	// -A: data copies skip what the filesystem at the source doesn't use
+	int alloc_only;
+	// -W scrubs read both tables whatever the cache (-K) says
+	int scrub;
 	uint32_t hdr_sz;
 	uint32_t part_sz;
 	uint8_t id[16];
-	mpart* parts;
+	// one mpart per table slot so lookup by number is direct, unused slots have index UINT32_MAX
+	mpart* pool;
+	// the populated slots in order of start_lba, part_entries long
+	mpart** parts;
+	// raw image of the partition table in whole blocks, identical for primary and backup
+	uint8_t* ptable;
+	// one flag per ptable block that has changed since it was last written
+	uint8_t* ptable_dirty;
+	uint64_t ptable_lb;
+	// raw (zero initial value) crc of the first PART_SZ bytes of every slot, zero for blank ones
+	uint32_t* slot_crc;
+	// -S: edits are held in memory until -C or the end of the commands
+	int staging;
+	int table_pending;
+	int mbr_pending;
 } gpt_dev;
 
 #define str(token) #token
 #define xstr(token) str(token)
-#define fail(...) do { fputs("crit: ", stderr); fprintf(stderr, __VA_ARGS__); fputs("\n", stderr); exit(EXIT_FAILURE); } while(0)
-#define warn(...) do { fputs("warn: ", stderr); fprintf(stderr, __VA_ARGS__); fputs("\n", stderr); } while(0)
+#define fail(...) do { fputs("crit: ", ERR); fprintf(ERR, __VA_ARGS__); fputs("\n", ERR); if(fail_jmp) { longjmp(*fail_jmp, 1); } exit(EXIT_FAILURE); } while(0)
+#define warn(...) do { fputs("warn: ", ERR); fprintf(ERR, __VA_ARGS__); fputs("\n", ERR); } while(0)
 #define wr(condition, msg, code) do { if(condition) { warn(msg "\n"); return code; } } while(0)
 
 int digits(uint64_t i) {
@@ -233,62 +374,360 @@ const uint32_t crc32_tab[] = {
 	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
-uint32_t crc32(uint32_t start, const void *buf, size_t size) {
-	const uint8_t *p = buf;
-	uint32_t crc;
+// slicing-by-8 tables, crc32_slice[0] is the same as crc32_tab
+uint32_t crc32_slice[8][256];
 
-	crc = start ^ 0xFFFFFFFF;
+uint32_t crc32_bytes(uint32_t crc, const uint8_t* p, size_t size) {
 	while(size--) {
 		crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
 	}
-	return crc ^ 0xFFFFFFFF;
+	return crc;
 }
 
-// without needing a buffer predict the crc32 for a given number of blank bytes
-uint32_t crc32_zero(uint32_t start, size_t size) {
-	uint32_t crc;
+// crc in and out are the raw (non-inverted) register value
+uint32_t crc32_slice8(uint32_t crc, const uint8_t* p, size_t size) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t word;
 
-	crc = start ^ 0xFFFFFFFF;
-	while(size--) {
-		crc = crc32_tab[crc & 0xFF] ^ (crc >> 8);
+	// align so the wide loads don't straddle cache lines
+	while(size && ((uintptr_t)p & 7)) {
+		crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+		size--;
+	}
+	while(size >= 8) {
+		memcpy(&word, p, 8);
+		word ^= crc;
+		crc = crc32_slice[7][word & 0xFF] ^
+			crc32_slice[6][(word >> 8) & 0xFF] ^
+			crc32_slice[5][(word >> 16) & 0xFF] ^
+			crc32_slice[4][(word >> 24) & 0xFF] ^
+			crc32_slice[3][(word >> 32) & 0xFF] ^
+			crc32_slice[2][(word >> 40) & 0xFF] ^
+			crc32_slice[1][(word >> 48) & 0xFF] ^
+			crc32_slice[0][word >> 56];
+		p += 8;
+		size -= 8;
+	}
+#endif
+	return crc32_bytes(crc, p, size);
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+// carry-less multiply folding, see Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ"
+// constants are the bit-reflected ones for the crc32 (0xedb88320) polynomial given at the end of the paper
+// needs size >= 64, only whole 16 byte blocks are consumed, returns the raw register value
+__attribute__((target("pclmul,sse4.1")))
+uint32_t crc32_clmul_blocks(uint32_t crc, const uint8_t* p, size_t size) {
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	p += 64;
+	size -= 64;
+
+	// fold 4x128 bits in parallel
+	while(size >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(p + 0x30)));
+		p += 64;
+		size -= 64;
+	}
+
+	// fold the 4 lanes into one
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	// any remaining single 128 bit blocks
+	while(size >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)p)), x5);
+		p += 16;
+		size -= 16;
+	}
+
+	// 128 -> 64 bits
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// barrett reduction down to 32 bits
+	x2 = _mm_and_si128(x1, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+uint32_t crc32_clmul(uint32_t crc, const uint8_t* p, size_t size) {
+	size_t blocks;
+
+	// not worth the setup for tiny buffers
+	if(size >= 64) {
+		blocks = size & ~(size_t)15;
+		crc = crc32_clmul_blocks(crc, p, blocks);
+		p += blocks;
+		size -= blocks;
+	}
+	return crc32_slice8(crc, p, size);
+}
+#endif
+
+uint32_t (*crc32_impl)(uint32_t crc, const uint8_t* p, size_t size) = crc32_slice8;
+
+// x^(2^k) mod P, used to skip over runs of zero bytes without touching them
+uint32_t crc32_x2n[32];
+
+// multiply a and b modulo the crc polynomial (bit-reflected, a must not be zero)
+uint32_t crc32_multmodp(uint32_t a, uint32_t b) {
+	uint32_t m = (uint32_t)1 << 31;
+	uint32_t p = 0;
+
+	for(;;) {
+		if(a & m) {
+			p ^= b;
+			if((a & (m - 1)) == 0) { break; }
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ 0xedb88320 : b >> 1;
+	}
+	return p;
+}
+
+// x^(n * 2^k) mod P
+uint32_t crc32_x2nmodp(uint64_t n, unsigned int k) {
+	uint32_t p = (uint32_t)1 << 31; // x^0 == 1
+
+	while(n) {
+		if(n & 1) {
+			p = crc32_multmodp(crc32_x2n[k & 31], p);
+		}
+		n >>= 1;
+		k++;
+	}
+	return p;
+}
+
+// build the derived tables and choose the fastest kernel the cpu supports
+__attribute__((constructor))
+void crc32_init() {
+	uint32_t p;
+
+	for(int i = 0; i < 256; i++) {
+		crc32_slice[0][i] = crc32_tab[i];
+	}
+	for(int i = 0; i < 256; i++) {
+		for(int s = 1; s < 8; s++) {
+			crc32_slice[s][i] = crc32_tab[crc32_slice[s-1][i] & 0xFF] ^ (crc32_slice[s-1][i] >> 8);
+		}
 	}
-	return crc ^ 0xFFFFFFFF;
+
+	p = (uint32_t)1 << 30; // x^1
+	crc32_x2n[0] = p;
+	for(int i = 1; i < 32; i++) {
+		crc32_x2n[i] = p = crc32_multmodp(p, p);
+	}
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+		crc32_impl = crc32_clmul;
+	}
+#endif
+}
+
+uint32_t crc32(uint32_t start, const void *buf, size_t size) {
+	return crc32_impl(start ^ 0xFFFFFFFF, buf, size) ^ 0xFFFFFFFF;
+}
+
+// without needing a buffer predict the crc32 for a given number of blank bytes
+// appending a zero byte is just a multiply by x^8, so do all of them at once in O(log n)
+uint32_t crc32_zero(uint32_t start, size_t size) {
+	return crc32_multmodp(crc32_x2nmodp(size, 3), start ^ 0xFFFFFFFF) ^ 0xFFFFFFFF;
 }
 
 #define UUID_STR_SZ 37
+// the byte behind each pair of hex digits in the string
+// the first 3 sections are little-endian for...reasons? reasons.
+const uint8_t uuid_order[16] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+const char hex_digit[16] = "0123456789abcdef";
+// value of a hex digit in either case, -1 for any other character
+const int8_t hex_value[256] = {
+	[0 ... 255] = -1,
+	['0'] = 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+	['a'] = 10, 11, 12, 13, 14, 15,
+	['A'] = 10, 11, 12, 13, 14, 15,
+};
+
+// a dash goes before these bytes
+int uuid_dash(int i) {
+	return i == 4 || i == 6 || i == 8 || i == 10;
+}
+
 void uuid_str(char* str, uint8_t* bytes) {
-	// the first 3 sections are little-endian for...reasons? reasons.
-	snprintf(
-		str, UUID_STR_SZ,
-		"%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
-		bytes[3],  bytes[2],  bytes[1],  bytes[0],
-		bytes[5],  bytes[4],
-		bytes[7],  bytes[6],
-		bytes[8],  bytes[9],  bytes[10], bytes[11],
-		bytes[12], bytes[13], bytes[14], bytes[15]
-	);
+	for(int i = 0; i < 16; i++) {
+		if(uuid_dash(i)) { *str++ = '-'; }
+		*str++ = hex_digit[bytes[uuid_order[i]] >> 4];
+		*str++ = hex_digit[bytes[uuid_order[i]] & 0xf];
+	}
+	*str = '\0';
 }
 
 void parse_uuid(char* in, uint8_t* dst) {
-	if(sscanf(in,
-		"%02hhx%02hhx%02hhx%02hhx-%02hhx%02hhx-%02hhx%02hhx-%02hhx%02hhx-%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx",
-		dst+3,  dst+2,  dst+1,  dst+0,
-		dst+5,  dst+4,
-		dst+7,  dst+6,
-		dst+8,  dst+9,  dst+10, dst+11,
-		dst+12, dst+13, dst+14, dst+15
-	) != 16) {
-		fail("could not parse UUID!");
+	int hi;
+	int lo;
+
+	for(int i = 0; i < 16; i++) {
+		if(uuid_dash(i) && *in++ != '-') { fail("could not parse UUID!"); }
+		// a short string stops at its null, which is never a digit
+		if((hi = hex_value[(uint8_t)in[0]]) < 0 || (lo = hex_value[(uint8_t)in[1]]) < 0) {
+			fail("could not parse UUID!");
+		}
+		dst[uuid_order[i]] = hi << 4 | lo;
+		in += 2;
 	}
+	if(*in != '\0') { fail("could not parse UUID!"); }
 }
 
-int not_zero(uint8_t* buf, size_t sz) {
-	for(size_t i = 0; i < sz; i++) {
-		if(buf[i] != 0) {
-			return 1;
-		}
+// type GUID aliases, compiled in from gpt.ids (see gpt_ids.sh)
+typedef struct {
+	uint8_t guid[16];
+	const char* name;
+} type_alias;
+#include "gpt_ids.h"
+
+// linux-generic, the default type
+const uint8_t type_linux_generic[16] = {
+	0xaf, 0x3d, 0xc6, 0x0f, 0x83, 0x84, 0x72, 0x47, 0x8e, 0x79, 0x3d, 0x69, 0xd8, 0x47, 0x7d, 0xe4
+};
+
+int type_cmp_guid(const void* key, const void* t) {
+	return memcmp(key, ((const type_alias*)t)->guid, 16);
+}
+
+int type_cmp_name(const void* key, const void* t) {
+	return strcmp(key, ((const type_alias*)t)->name);
+}
+
+// alias of a type GUID, or NULL if gpt.ids doesn't list it
+const char* type_name(const uint8_t* guid) {
+	const type_alias* t = bsearch(guid, type_by_guid, sizeof(type_by_guid) / sizeof(type_by_guid[0]),
+		sizeof(type_alias), type_cmp_guid);
+	return t ? t->name : NULL;
+}
+
+// a type is an alias from gpt.ids or a UUID
+void parse_type(char* in, uint8_t* dst) {
+	const type_alias* t = bsearch(in, type_by_name, sizeof(type_by_name) / sizeof(type_by_name[0]),
+		sizeof(type_alias), type_cmp_name);
+	if(t) {
+		memcpy(dst, t->guid, 16);
+	} else {
+		parse_uuid(in, dst);
 	}
-	return 0;
+}
+
+// length of the all-zero start of a buffer, a word at a time
+size_t zero_len_words(const uint8_t* p, size_t size) {
+	uint64_t w[4];
+	size_t i = 0;
+
+	for(; i + 32 <= size; i += 32) {
+		memcpy(w, p + i, 32);
+		if((w[0] | w[1] | w[2] | w[3]) != 0) { break; }
+	}
+	for(; i + 8 <= size; i += 8) {
+		memcpy(w, p + i, 8);
+		if(w[0] != 0) { break; }
+	}
+	// pin down the byte, in the word that stopped the scan or the tail
+	for(; i < size && p[i] == 0; i++);
+	return i;
+}
+
+#if defined(__x86_64__)
+// sse2 is always there on x86_64
+size_t zero_len_sse2(const uint8_t* p, size_t size) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i x;
+	size_t i = 0;
+
+	for(; i + 64 <= size; i += 64) {
+		x = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((__m128i*)(p + i)), _mm_loadu_si128((__m128i*)(p + i + 16))),
+			_mm_or_si128(_mm_loadu_si128((__m128i*)(p + i + 32)), _mm_loadu_si128((__m128i*)(p + i + 48))));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) != 0xffff) { break; }
+	}
+	return i + zero_len_words(p + i, size - i);
+}
+
+__attribute__((target("avx2")))
+size_t zero_len_avx2(const uint8_t* p, size_t size) {
+	__m256i x;
+	size_t i = 0;
+
+	for(; i + 128 <= size; i += 128) {
+		x = _mm256_or_si256(
+			_mm256_or_si256(_mm256_loadu_si256((__m256i*)(p + i)), _mm256_loadu_si256((__m256i*)(p + i + 32))),
+			_mm256_or_si256(_mm256_loadu_si256((__m256i*)(p + i + 64)), _mm256_loadu_si256((__m256i*)(p + i + 96))));
+		if(!_mm256_testz_si256(x, x)) { break; }
+	}
+	return i + zero_len_sse2(p + i, size - i);
+}
+
+size_t (*zero_len_impl)(const uint8_t* p, size_t size) = zero_len_sse2;
+#else
+size_t (*zero_len_impl)(const uint8_t* p, size_t size) = zero_len_words;
+#endif
+
+__attribute__((constructor))
+void zero_init() {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		zero_len_impl = zero_len_avx2;
+	}
+#endif
+}
+
+size_t zero_len(const uint8_t* buf, size_t sz) {
+	return zero_len_impl(buf, sz);
+}
+
+int not_zero(uint8_t* buf, size_t sz) {
+	return zero_len_impl(buf, sz) != sz;
 }
 
 void gen_guid4(uint8_t* dst) {
@@ -302,116 +741,652 @@ void gen_guid4(uint8_t* dst) {
 	dst[8] = dst[8] & 0x3f | 0x80;
 }
 
-void safeseek(int fd, off_t offset) {
-	if(lseek(fd, offset, SEEK_SET) == -1) {
+void safewrite(int fd, void* buf, size_t count) {
+	if(write(fd, buf, count) != count) {
 		perror("");
-		fail("seek failure!");
+		fail("write failure!");
 	}
 }
 
-void saferead(int fd, void* buf, size_t count) {
-	if(read(fd, buf, count) != count) {
-		perror("");
-		fail("read failure!");
+// one transfer in a batch, reads use only the first iovec
+// a write without any iovecs is a barrier, see io_write_batch
+typedef struct {
+	off_t offset;
+	struct iovec iov[2];
+	int iovcnt;
+	ssize_t result;
+} io_req;
+
+// all device I/O goes through one of these, reads and writes are positional
+// so they are safe to use from several threads sharing one device
+typedef struct io_ops {
+	char* name;
+	// non-zero if the backend can't be used for this device
+	int (*setup)(gpt_dev* dev);
+	ssize_t (*read)(gpt_dev* dev, void* buf, size_t count, off_t offset);
+	ssize_t (*writev)(gpt_dev* dev, struct iovec* iov, int iovcnt, off_t offset);
+	// the bytes in place if the backend holds them, otherwise NULL
+	uint8_t* (*view)(gpt_dev* dev, off_t offset, size_t count);
+	void (*teardown)(gpt_dev* dev);
+	// optional, for backends that can have a whole batch in flight at once
+	void (*read_batch)(gpt_dev* dev, io_req* reqs, int n);
+	int (*write_batch)(gpt_dev* dev, io_req* reqs, int n);
+	// optional, zero a block aligned range without sending zeros, non-zero if the device can't
+	int (*zero)(gpt_dev* dev, off_t offset, size_t count);
+} io_ops;
+
+int io_none_setup(gpt_dev* dev) { return 0; }
+uint8_t* io_none_view(gpt_dev* dev, off_t offset, size_t count) { return NULL; }
+void io_none_teardown(gpt_dev* dev) {}
+
+// the device does the zeroing, sparse images stay sparse and thin volumes stay unallocated
+int io_fd_zero(gpt_dev* dev, off_t offset, size_t count) {
+	uint64_t range[2] = { offset, count };
+	struct stat st;
+
+	if(fstat(dev->fd, &st) != 0) { return -1; }
+	if(S_ISBLK(st.st_mode)) {
+		return ioctl(dev->fd, BLKZEROOUT, range);
 	}
+	// not every filesystem can punch holes, zero range still avoids writing the data
+	if(fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, count) == 0) { return 0; }
+	return fallocate(dev->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, count);
 }
 
-void safewrite(int fd, void* buf, size_t count) {
-	if(write(fd, buf, count) != count) {
+ssize_t io_pread_read(gpt_dev* dev, void* buf, size_t count, off_t offset) {
+	return pread(dev->fd, buf, count, offset);
+}
+
+ssize_t io_pread_writev(gpt_dev* dev, struct iovec* iov, int iovcnt, off_t offset) {
+	return pwritev(dev->fd, iov, iovcnt, offset);
+}
+
+// map the whole device or image, reads and writes become memcpy
+int io_mmap_setup(gpt_dev* dev) {
+	off_t size;
+	int prot = PROT_READ;
+
+	if((size = lseek(dev->fd, 0, SEEK_END)) <= 0) { return -1; }
+	dev->map_writable = (fcntl(dev->fd, F_GETFL) & O_ACCMODE) == O_RDWR;
+	if(dev->map_writable) { prot |= PROT_WRITE; }
+	if((dev->map = mmap(NULL, size, prot, MAP_SHARED, dev->fd, 0)) == MAP_FAILED) {
+		dev->map = NULL;
+		return -1;
+	}
+	dev->map_sz = size;
+	return 0;
+}
+
+ssize_t io_mmap_read(gpt_dev* dev, void* buf, size_t count, off_t offset) {
+	// short read at the end, like pread
+	if(offset >= dev->map_sz) { return 0; }
+	count = min(count, dev->map_sz - offset);
+	memcpy(buf, dev->map + offset, count);
+	return count;
+}
+
+ssize_t io_mmap_writev(gpt_dev* dev, struct iovec* iov, int iovcnt, off_t offset) {
+	size_t count = 0;
+
+	for(int i = 0; i < iovcnt; i++) {
+		count += iov[i].iov_len;
+	}
+	// a mapping can't grow the file
+	if(!dev->map_writable || offset + count > dev->map_sz) {
+		errno = dev->map_writable ? EFBIG : EBADF;
+		return -1;
+	}
+	for(int i = 0; i < iovcnt; i++) {
+		memcpy(dev->map + offset, iov[i].iov_base, iov[i].iov_len);
+		offset += iov[i].iov_len;
+	}
+	return count;
+}
+
+uint8_t* io_mmap_view(gpt_dev* dev, off_t offset, size_t count) {
+	if(offset + count > dev->map_sz) { return NULL; }
+	return dev->map + offset;
+}
+
+void io_mmap_teardown(gpt_dev* dev) {
+	if(dev->map_writable && msync(dev->map, dev->map_sz, MS_SYNC) != 0) {
 		perror("");
-		fail("write failure!");
+		fail("could not sync mapped writes!");
 	}
+	munmap(dev->map, dev->map_sz);
+	dev->map = NULL;
+	dev->map_sz = 0;
 }
 
-void seekread(int fd, off_t offset, void* buf, size_t count) {
-	safeseek(fd, offset);
-	saferead(fd, buf, count);
+// reads come from the device with every held write laid over them, nothing is ever written
+// past the end of the device reads as zero, so images can be planned bigger than they are
+ssize_t io_mem_read(gpt_dev* dev, void* buf, size_t count, off_t offset) {
+	ssize_t r;
+	off_t start;
+	off_t end;
+
+	if((r = pread(dev->fd, buf, count, offset)) == -1) { return -1; }
+	memset((uint8_t*)buf + r, 0, count - r);
+
+	// in write order so later writes win
+	pthread_mutex_lock(&dev->io_lock);
+	for(size_t i = 0; i < dev->mem_count; i++) {
+		start = max(offset, dev->mem[i].offset);
+		end = min(offset + (off_t)count, dev->mem[i].offset + (off_t)dev->mem[i].len);
+		if(start < end) {
+			memcpy((uint8_t*)buf + (start - offset), dev->mem[i].data + (start - dev->mem[i].offset), end - start);
+		}
+	}
+	pthread_mutex_unlock(&dev->io_lock);
+	return count;
 }
 
-// if not zero return -1
-int read_zero(int fd, size_t count) {
-	uint8_t buf[BLOCK_SZ] = {0};
+ssize_t io_mem_writev(gpt_dev* dev, struct iovec* iov, int iovcnt, off_t offset) {
+	size_t count = 0;
+	mem_extent* ext;
+
+	pthread_mutex_lock(&dev->io_lock);
+	if((dev->mem = realloc(dev->mem, (dev->mem_count + iovcnt) * sizeof(mem_extent))) == NULL) { fail("memfail"); }
+	for(int i = 0; i < iovcnt; i++) {
+		ext = &dev->mem[dev->mem_count++];
+		ext->offset = offset + count;
+		ext->len = iov[i].iov_len;
+		if((ext->data = malloc(ext->len)) == NULL) { fail("memfail"); }
+		memcpy(ext->data, iov[i].iov_base, ext->len);
+		count += ext->len;
+	}
+	pthread_mutex_unlock(&dev->io_lock);
+	return count;
+}
+
+void io_mem_teardown(gpt_dev* dev) {
+	for(size_t i = 0; i < dev->mem_count; i++) {
+		free(dev->mem[i].data);
+	}
+	free(dev->mem);
+	dev->mem = NULL;
+	dev->mem_count = 0;
+}
+
+// O_DIRECT, every transfer is whole logical blocks through an aligned bounce buffer
+int io_direct_setup(gpt_dev* dev) {
+	int flags = fcntl(dev->fd, F_GETFL);
+	if(flags == -1 || fcntl(dev->fd, F_SETFL, flags | O_DIRECT) != 0) { return -1; }
+	return 0;
+}
+
+void io_direct_teardown(gpt_dev* dev) {
+	fcntl(dev->fd, F_SETFL, fcntl(dev->fd, F_GETFL) & ~O_DIRECT);
+}
+
+// some filesystems take the flag and then refuse the I/O, carry on through the page cache
+int io_direct_rejected(gpt_dev* dev) {
+	if(errno != EINVAL || !(fcntl(dev->fd, F_GETFL) & O_DIRECT)) { return 0; }
+	warn("%s refused O_DIRECT I/O, using the page cache", dev->device);
+	io_direct_teardown(dev);
+	return 1;
+}
+
+uint8_t* io_direct_bounce(gpt_dev* dev, size_t len) {
+	void* buf;
+	if(posix_memalign(&buf, max(dev->lbsz, 4096), len) != 0) { fail("memfail"); }
+	return buf;
+}
+
+// past the end of the device reads as zero, returns how much was really there
+ssize_t io_direct_pread(gpt_dev* dev, uint8_t* bounce, size_t len, off_t start) {
+	ssize_t r;
+	while((r = pread(dev->fd, bounce, len, start)) == -1 && io_direct_rejected(dev));
+	if(r != -1) { memset(bounce + r, 0, len - r); }
+	return r;
+}
+
+ssize_t io_direct_read(gpt_dev* dev, void* buf, size_t count, off_t offset) {
+	off_t start = offset - (offset % dev->lbsz);
+	size_t len = ((offset + count - start) + dev->lbsz - 1) / dev->lbsz * dev->lbsz;
+	uint8_t* bounce = io_direct_bounce(dev, len);
+	ssize_t r;
+
+	if((r = io_direct_pread(dev, bounce, len, start)) != -1) {
+		// short at the end of the device, like pread
+		r = max(0, min((ssize_t)count, r - (offset - start)));
+		memcpy(buf, bounce + (offset - start), r);
+	}
+	free(bounce);
+	return r;
+}
+
+ssize_t io_direct_writev(gpt_dev* dev, struct iovec* iov, int iovcnt, off_t offset) {
+	size_t count = 0;
+	off_t start = offset - (offset % dev->lbsz);
+	size_t len;
+	uint8_t* bounce;
+	uint8_t* at;
+	ssize_t r;
+
+	for(int i = 0; i < iovcnt; i++) {
+		count += iov[i].iov_len;
+	}
+	len = ((offset + count - start) + dev->lbsz - 1) / dev->lbsz * dev->lbsz;
+	bounce = io_direct_bounce(dev, len);
+
+	// partial blocks at either end keep what is already there
+	if((offset != start || count != len) && io_direct_pread(dev, bounce, len, start) == -1) {
+		free(bounce);
+		return -1;
+	}
+	at = bounce + (offset - start);
+	for(int i = 0; i < iovcnt; i++) {
+		memcpy(at, iov[i].iov_base, iov[i].iov_len);
+		at += iov[i].iov_len;
+	}
+	while((r = pwrite(dev->fd, bounce, len, start)) == -1 && io_direct_rejected(dev));
+	free(bounce);
+	return r == len ? count : -1;
+}
+
+// io_uring, talked to directly since it only needs a few syscalls
+#define IO_RING_ENTRIES 64
+typedef struct io_ring {
+	int fd;
+	unsigned int entries;
+	void* sq_map;
+	size_t sq_map_sz;
+	void* cq_map;
+	size_t cq_map_sz;
+	struct io_uring_sqe* sqes;
+	size_t sqes_sz;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_cqe* cqes;
+} io_ring;
+
+void io_uring_teardown(gpt_dev* dev) {
+	io_ring* r = dev->ring;
+
+	if(r == NULL) { return; }
+	if(r->sqes) { munmap(r->sqes, r->sqes_sz); }
+	if(r->cq_map && r->cq_map != r->sq_map) { munmap(r->cq_map, r->cq_map_sz); }
+	if(r->sq_map) { munmap(r->sq_map, r->sq_map_sz); }
+	close(r->fd);
+	free(r);
+	dev->ring = NULL;
+}
+
+// non-zero if the kernel doesn't have io_uring or won't let us use it
+int io_uring_setup_ring(gpt_dev* dev) {
+	struct io_uring_params p = {0};
+	io_ring* r;
+
+	dev->ring = NULL;
+	if((r = calloc(1, sizeof(io_ring))) == NULL) { fail("memfail"); }
+	if((r->fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &p)) < 0) {
+		free(r);
+		return -1;
+	}
+	dev->ring = r;
+	r->entries = p.sq_entries;
+
+	r->sq_map_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_map_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->sq_map_sz = r->cq_map_sz = max(r->sq_map_sz, r->cq_map_sz);
+	}
+	r->sq_map = mmap(NULL, r->sq_map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if(r->sq_map == MAP_FAILED) { r->sq_map = NULL; io_uring_teardown(dev); return -1; }
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_map = r->sq_map;
+	} else {
+		r->cq_map = mmap(NULL, r->cq_map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if(r->cq_map == MAP_FAILED) { r->cq_map = NULL; io_uring_teardown(dev); return -1; }
+	}
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sqes == MAP_FAILED) { r->sqes = NULL; io_uring_teardown(dev); return -1; }
+
+	r->sq_tail = (unsigned int*)((uint8_t*)r->sq_map + p.sq_off.tail);
+	r->sq_mask = (unsigned int*)((uint8_t*)r->sq_map + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int*)((uint8_t*)r->sq_map + p.sq_off.array);
+	r->cq_head = (unsigned int*)((uint8_t*)r->cq_map + p.cq_off.head);
+	r->cq_tail = (unsigned int*)((uint8_t*)r->cq_map + p.cq_off.tail);
+	r->cq_mask = (unsigned int*)((uint8_t*)r->cq_map + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)((uint8_t*)r->cq_map + p.cq_off.cqes);
+	return 0;
+}
+
+// submit up to a ring's worth of requests and wait for all of them, results go in reqs
+// writes are linked so they run in order and anything after a failure is cancelled
+int io_uring_submit_locked(gpt_dev* dev, io_req* reqs, int n, int write) {
+	io_ring* r = dev->ring;
+	struct io_uring_sqe* sqe;
+	unsigned int tail = *r->sq_tail;
+	unsigned int head;
+	unsigned int slot;
+	int submitted = 0;
+	int completed = 0;
+	int ret;
+
+	for(int i = 0; i < n; i++) {
+		slot = (tail + i) & *r->sq_mask;
+		sqe = &r->sqes[slot];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->fd = dev->fd;
+		sqe->user_data = i;
+		if(write && reqs[i].iovcnt == 0) {
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		} else {
+			sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->addr = (uintptr_t)reqs[i].iov;
+			sqe->len = write ? reqs[i].iovcnt : 1;
+			sqe->off = reqs[i].offset;
+		}
+		if(write && i + 1 < n) { sqe->flags = IOSQE_IO_LINK; }
+		r->sq_array[slot] = slot;
+	}
+	__atomic_store_n(r->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+	while(completed < n) {
+		ret = syscall(__NR_io_uring_enter, r->fd, n - submitted, n - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(ret < 0) {
+			if(errno == EINTR) { continue; }
+			return -1;
+		}
+		submitted += ret;
+		head = *r->cq_head;
+		while(head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			reqs[r->cqes[head & *r->cq_mask].user_data].result = r->cqes[head & *r->cq_mask].res;
+			head++;
+			completed++;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+// one submitter at a time, the ring has no room for another thread's completions
+int io_uring_submit(gpt_dev* dev, io_req* reqs, int n, int write) {
+	int ret;
 
-	while(count > BLOCK_SZ) {
-		count = count - BLOCK_SZ;
-		saferead(fd, buf, BLOCK_SZ);
-		if(not_zero(buf, BLOCK_SZ)) { return -1; }
+	pthread_mutex_lock(&dev->io_lock);
+	ret = io_uring_submit_locked(dev, reqs, n, write);
+	pthread_mutex_unlock(&dev->io_lock);
+	return ret;
+}
+
+void io_uring_read_batch(gpt_dev* dev, io_req* reqs, int n) {
+	for(int i = 0; i < n; i += dev->ring->entries) {
+		if(io_uring_submit(dev, reqs + i, min(n - i, dev->ring->entries), 0) != 0) {
+			perror("");
+			fail("read failure!");
+		}
 	}
-	if(count) {
-		saferead(fd, buf, count);
-		if(not_zero(buf, count)) { return -1; }
+	for(int i = 0; i < n; i++) {
+		// same convention as pread
+		if(reqs[i].result < 0) {
+			errno = -reqs[i].result;
+			reqs[i].result = -1;
+		}
 	}
+}
 
+// chunks of a long batch are submitted one at a time and checked before the next goes out
+// links only cancel within a chunk, so a failed write or barrier must stop the rest here
+int io_uring_write_batch(gpt_dev* dev, io_req* reqs, int n) {
+	size_t count;
+	int chunk;
+
+	for(int i = 0; i < n; i += chunk) {
+		chunk = min(n - i, dev->ring->entries);
+		if(io_uring_submit(dev, reqs + i, chunk, 1) != 0) { return -1; }
+		for(int k = i; k < i + chunk; k++) {
+			count = 0;
+			for(int j = 0; j < reqs[k].iovcnt; j++) {
+				count += reqs[k].iov[j].iov_len;
+			}
+			if(reqs[k].result < 0) {
+				errno = -reqs[k].result;
+				return -1;
+			}
+			if(reqs[k].result != count) {
+				errno = EIO;
+				return -1;
+			}
+		}
+	}
 	return 0;
 }
 
+ssize_t io_uring_read(gpt_dev* dev, void* buf, size_t count, off_t offset) {
+	io_req req = { offset, { { buf, count } }, 1 };
+	io_uring_read_batch(dev, &req, 1);
+	return req.result;
+}
+
+ssize_t io_uring_writev(gpt_dev* dev, struct iovec* iov, int iovcnt, off_t offset) {
+	io_req req = { offset, { iov[0] }, 1 };
+	size_t count = 0;
+
+	// anything longer goes through one request per buffer
+	if(iovcnt > 2) {
+		for(int i = 0; i < iovcnt; i++) {
+			if(io_uring_writev(dev, &iov[i], 1, offset + count) != iov[i].iov_len) { return -1; }
+			count += iov[i].iov_len;
+		}
+		return count;
+	}
+	if(iovcnt == 2) {
+		req.iov[1] = iov[1];
+		req.iovcnt = 2;
+	}
+	if(io_uring_write_batch(dev, &req, 1) != 0) { return -1; }
+	return req.result;
+}
+
+const io_ops io_backends[] = {
+	// mem has no zero, held writes must see the zeros too
+	{ "pread", io_none_setup, io_pread_read, io_pread_writev, io_none_view, io_none_teardown, NULL, NULL, io_fd_zero },
+	{ "mmap", io_mmap_setup, io_mmap_read, io_mmap_writev, io_mmap_view, io_mmap_teardown, NULL, NULL, io_fd_zero },
+	{ "mem", io_none_setup, io_mem_read, io_mem_writev, io_none_view, io_mem_teardown },
+	{ "direct", io_direct_setup, io_direct_read, io_direct_writev, io_none_view, io_direct_teardown, NULL, NULL, io_fd_zero },
+	{ "uring", io_uring_setup_ring, io_uring_read, io_uring_writev, io_none_view, io_uring_teardown, io_uring_read_batch, io_uring_write_batch, io_fd_zero },
+};
+// what open_device starts with, -I before any DEVICE changes it for printing all devices
+const io_ops* io_default = &io_backends[0];
+
+const io_ops* io_find(char* name) {
+	for(int i = 0; i < sizeof(io_backends) / sizeof(io_backends[0]); i++) {
+		if(strcmp(name, io_backends[i].name) == 0) { return &io_backends[i]; }
+	}
+	fail("unknown I/O backend %s!", name);
+}
+
+// switch backends, anything the old one held is flushed (mmap) or dropped (mem)
+void io_use(gpt_dev* dev, const io_ops* io) {
+	if(dev->io) { dev->io->teardown(dev); }
+	dev->io = io;
+	if(dev->io->setup(dev) != 0) {
+		warn("%s I/O is not available for %s, using pread", io->name, dev->device);
+		dev->io = &io_backends[0];
+	}
+}
+
+void seekread(gpt_dev* dev, off_t offset, void* buf, size_t count) {
+	if(dev->io->read(dev, buf, count, offset) != count) {
+		perror("");
+		fail("read failure!");
+	}
+}
+
 // if not zero return -1
-int seekread_zero(int fd, off_t offset, size_t count) {
-	safeseek(fd, offset);
-	return read_zero(fd, count);
+int seekread_zero(gpt_dev* dev, off_t offset, size_t count) {
+	uint8_t small[BLOCK_SZ];
+	uint8_t* buf = small;
+	size_t buf_sz = BLOCK_SZ;
+	uint8_t* view;
+	size_t n;
+	int ret = 0;
+
+	if((view = dev->io->view(dev, offset, count)) != NULL) {
+		return not_zero(view, count) ? -1 : 0;
+	}
+	// anything past a block is read in big page aligned pieces
+	if(count > BLOCK_SZ) {
+		// min doesn't parenthesize its arguments, round first
+		buf_sz = (count + 4095) & ~(size_t)4095;
+		buf_sz = min(buf_sz, ZERO_CHUNK);
+		if((buf = aligned_alloc(4096, buf_sz)) == NULL) { fail("memfail"); }
+	}
+	while(count) {
+		n = min(count, buf_sz);
+		seekread(dev, offset, buf, n);
+		if(not_zero(buf, n)) {
+			ret = -1;
+			break;
+		}
+		offset += n;
+		count -= n;
+	}
+
+	if(buf != small) { free(buf); }
+	return ret;
 }
 
-void seekwrite(int fd, off_t offset, void* buf, size_t count) {
-	safeseek(fd, offset);
-	if(write(fd, buf, count) != count) { perror(""); fail("write"); }
+// gather several buffers into one contiguous write
+void seekwritev(gpt_dev* dev, off_t offset, struct iovec* iov, int iovcnt) {
+	size_t count = 0;
+	for(int i = 0; i < iovcnt; i++) {
+		count += iov[i].iov_len;
+	}
+	if(dev->io->writev(dev, iov, iovcnt, offset) != count) { perror(""); fail("write"); }
 }
 
-void write_zero(int fd, size_t count) {
-	uint8_t buf[BLOCK_SZ] = {0};
+void seekwrite(gpt_dev* dev, off_t offset, void* buf, size_t count) {
+	struct iovec iov = { buf, count };
+	seekwritev(dev, offset, &iov, 1);
+}
 
-	while(count > BLOCK_SZ) {
-		count = count - BLOCK_SZ;
-		safewrite(fd, buf, BLOCK_SZ);
+// reads in one submission when the backend can, otherwise one after another
+void io_read_batch(gpt_dev* dev, io_req* reqs, int n) {
+	if(dev->io->read_batch) {
+		dev->io->read_batch(dev, reqs, n);
+		return;
 	}
-	if(count) {
-		safewrite(fd, buf, count);
+	for(int i = 0; i < n; i++) {
+		reqs[i].result = dev->io->read(dev, reqs[i].iov[0].iov_base, reqs[i].iov[0].iov_len, reqs[i].offset);
+	}
+}
+
+// writes in order, a request without buffers is a barrier that flushes everything before it
+// backends without batching issue the same writes in the same order and have no barrier
+void io_write_batch(gpt_dev* dev, io_req* reqs, int n) {
+	if(dev->io->write_batch) {
+		if(dev->io->write_batch(dev, reqs, n) != 0) { perror(""); fail("write"); }
+		return;
+	}
+	for(int i = 0; i < n; i++) {
+		if(reqs[i].iovcnt) {
+			seekwritev(dev, reqs[i].offset, reqs[i].iov, reqs[i].iovcnt);
+		}
+	}
+}
+
+void seekwrite_zero(gpt_dev* dev, off_t offset, size_t count) {
+	uint8_t* buf;
+	size_t n;
+
+	if(dev->io->zero && dev->io->zero(dev, offset, count) == 0) { return; }
+
+	if((buf = calloc(1, min(count, ZERO_CHUNK))) == NULL) { fail("memfail"); }
+	while(count) {
+		n = min(count, ZERO_CHUNK);
+		seekwrite(dev, offset, buf, n);
+		offset += n;
+		count -= n;
 	}
+	free(buf);
 }
 
-void seekwrite_zero(int fd, off_t offset, size_t count) {
-	safeseek(fd, offset);
-	write_zero(fd, count);
+// one code point as UTF-8, returns the number of bytes written
+int utf8_put(char* out, uint32_t c) {
+	if(c < 0x80) {
+		out[0] = c;
+		return 1;
+	} else if(c < 0x800) {
+		out[0] = 0xc0 | (c >> 6);
+		out[1] = 0x80 | (c & 0x3f);
+		return 2;
+	} else if(c < 0x10000) {
+		out[0] = 0xe0 | (c >> 12);
+		out[1] = 0x80 | ((c >> 6) & 0x3f);
+		out[2] = 0x80 | (c & 0x3f);
+		return 3;
+	}
+	out[0] = 0xf0 | (c >> 18);
+	out[1] = 0x80 | ((c >> 12) & 0x3f);
+	out[2] = 0x80 | ((c >> 6) & 0x3f);
+	out[3] = 0x80 | (c & 0x3f);
+	return 4;
 }
 
-void c16tolocal(char16_t* in, char* out) {
-	mbstate_t ps = {0};
-	size_t r;
-	while(in[0] != u'\0') {
-		if((r = c16rtomb(out, in[0], &ps)) == -1) { fail("could not parse label!"); }
-		in++;
-		out += r;
+// the locale is always C.UTF-8, so labels are transcoded directly rather than through c16rtomb
+// a label that fills all len chars has no null
+void c16tolocal(char16_t* in, size_t len, char* out) {
+	uint32_t c;
+
+	for(size_t i = 0; i < len && in[i] != u'\0'; i++) {
+		c = in[i];
+		if(c >= 0xd800 && c < 0xdc00 && i + 1 < len && in[i+1] >= 0xdc00 && in[i+1] < 0xe000) {
+			c = 0x10000 + ((c - 0xd800) << 10) + (in[++i] - 0xdc00);
+		} else if(c >= 0xd800 && c < 0xe000) {
+			// unpaired surrogate
+			fail("could not parse label!");
+		}
+		out += utf8_put(out, c);
 	}
-	// write final null char
-	if(c16rtomb(out, in[0], &ps) == -1) { fail("could not parse label!"); }
+	*out = '\0';
 }
 
+// length of a UTF-8 sequence by its first byte, 0 if it can't start one (or would be overlong for 2 bytes)
+const uint8_t utf8_len[256] = {
+	[0x00 ... 0x7f] = 1,
+	[0xc2 ... 0xdf] = 2,
+	[0xe0 ... 0xef] = 3,
+	[0xf0 ... 0xf4] = 4,
+};
+// smallest code point each length may encode, anything less is overlong
+const uint32_t utf8_min[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+
+// a label fills up to len chars, null terminated if it is shorter
 void localtoc16(char* in, char16_t* out, size_t len) {
-	mbstate_t ps = {0};
-	size_t r;
-	char16_t* end = out + len;
-	
-	while(in[0] != '\0') {
-		r = mbrtoc16(out, in, 1, &ps);
-		switch(r) {
-			case -1:
-				fail("could not parse label!");
-			case -2:
-				in++;
-				break;
-			case -3:
-				out++;
-				break;
-			case 1:
-				in++;
-				out++;
-				break;
-			default:
-				fail("unexpected parsing error!");
-		}
-		if(out > end) { fail("label too long!"); }
-	}
-	// write final null char
-	if(mbrtoc16(out, in, 1, &ps) == -1) { fail("could not parse label!"); }
+	uint8_t* s = (uint8_t*)in;
+	size_t n = 0;
+	uint32_t c;
+	int bytes;
+
+	while(*s != '\0') {
+		if((bytes = utf8_len[*s]) == 0) { fail("could not parse label!"); }
+		c = *s++ & (0xff >> (bytes + (bytes > 1)));
+		for(int i = 1; i < bytes; i++) {
+			// the terminating null is not a continuation byte either
+			if((*s & 0xc0) != 0x80) { fail("could not parse label!"); }
+			c = c << 6 | (*s++ & 0x3f);
+		}
+		if(c < utf8_min[bytes] || c > 0x10ffff || (c >= 0xd800 && c < 0xe000)) { fail("could not parse label!"); }
+
+		if(n + (c >= 0x10000) >= len) { fail("label too long!"); }
+		if(c >= 0x10000) {
+			out[n++] = 0xd800 + ((c - 0x10000) >> 10);
+			out[n++] = 0xdc00 + ((c - 0x10000) & 0x3ff);
+		} else {
+			out[n++] = c;
+		}
+	}
+	if(n < len) { out[n] = u'\0'; }
 }
 
 #define VALID_GPT 0
@@ -422,13 +1397,94 @@ void localtoc16(char* in, char16_t* out, size_t len) {
 #define CORRUPT_BACKUP -5
 #define UNCHECKED -6
 
-int validate_header(gpt_hdr* hdr, gpt_dev* dev, uint64_t lba) {
+// size of the partition table in whole blocks
+uint64_t ptable_blocks(gpt_hdr* hdr, unsigned int lbsz) {
+	return (((uint64_t)hdr->ptable_entries * hdr->entry_size) + lbsz - 1) / lbsz;
+}
+
+// set up the read of a table into a new buffer of whole blocks, the buffer is NULL if hdr is too broken
+void ptable_req(gpt_dev* dev, gpt_hdr* hdr, io_req* req) {
+	uint64_t table_lb = ptable_blocks(hdr, dev->lbsz);
+
+	*req = (io_req){ hdr->ptable_lba * dev->lbsz, { { NULL, table_lb * dev->lbsz } }, 1 };
+	if(strncmp("EFI PART", hdr->signature, 8) != 0) { return; }
+	if(table_lb == 0 || hdr->ptable_lba <= 1 || hdr->ptable_lba + table_lb - 1 >= dev->last_lba) { return; }
+	if((req->iov[0].iov_base = malloc(req->iov[0].iov_len)) == NULL) { fail("memfail"); }
+}
+
+uint8_t* ptable_done(gpt_hdr* hdr, io_req* req) {
+	uint8_t* table = req->iov[0].iov_base;
+	uint64_t table_sz = (uint64_t)hdr->ptable_entries * hdr->entry_size;
+
+	if(table == NULL) { return NULL; }
+	if(req->result != req->iov[0].iov_len) { perror(""); fail("read failure!"); }
+	// whatever shares the last block with the end of the table is not ours to copy around
+	memset(table + table_sz, 0, req->iov[0].iov_len - table_sz);
+	return table;
+}
+
+uint8_t* fetch_ptable(gpt_dev* dev, gpt_hdr* hdr) {
+	io_req req;
+
+	ptable_req(dev, hdr, &req);
+	if(req.iov[0].iov_base) {
+		req.result = dev->io->read(dev, req.iov[0].iov_base, req.iov[0].iov_len, req.offset);
+	}
+	return ptable_done(hdr, &req);
+}
+
+typedef struct {
+	gpt_dev* dev;
+	gpt_hdr* hdr;
+	uint8_t* table;
+} ptable_fetch;
+
+void* fetch_ptable_thread(void* arg) {
+	ptable_fetch* f = arg;
+	f->table = fetch_ptable(f->dev, f->hdr);
+	return NULL;
+}
+
+// check every entry of an in-memory copy of the partition table, counting the populated ones
+int validate_ptable(gpt_hdr* hdr, uint8_t* table, uint32_t* count) {
+	part_entry* part;
+
+	*count = 0;
+	for(uint32_t i = 0; i < hdr->ptable_entries; i++) {
+		part = (part_entry*)(table + ((size_t)i * hdr->entry_size));
+		// blank entries come in runs, skip every one that is all zero at once
+		if(!not_zero(part->type, 16)) {
+			i += zero_len((uint8_t*)part, (size_t)(hdr->ptable_entries - i) * hdr->entry_size) / hdr->entry_size;
+			if(i >= hdr->ptable_entries) { break; }
+			part = (part_entry*)(table + ((size_t)i * hdr->entry_size));
+		}
+		wr((part->attr & 0b0000000000000000111111111111111111111111111111111111111111111000)!= 0,
+		"unexpected partition attributes in reserved field!", UNEXPECTED);
+		// each entry may be bigger than 128, but the extra space *must* be zeroed
+		if(hdr->entry_size > PART_SZ) {
+			wr(not_zero((uint8_t*)part + PART_SZ, hdr->entry_size - PART_SZ), "reserved portion of part entry not zero!", UNEXPECTED);
+		}
+
+		if(not_zero(part->type, 16)) {
+			(*count)++;
+		// if not a real entry verify the entire entry is zero
+		} else if(not_zero((uint8_t*)part, PART_SZ)){
+			warn("populated fields found in blank entry!");
+			return UNEXPECTED;
+		}
+	}
+	// reserved space is already known to be zero, so the whole table can be summed in one go
+	wr(crc32(0, table, (size_t)hdr->ptable_entries * hdr->entry_size) != hdr->ptable_crc, "corrupted partition table!", CORRUPT_PTABLE);
+
+	return 0;
+}
+
+// everything about a header that can be checked without reading its table
+// the table is only worth fetching once this passes, a flipped bit in its size could ask for gigabytes
+int check_header(gpt_hdr* hdr, gpt_dev* dev, uint64_t lba) {
 	uint32_t reported_crc;
 	uint32_t calc_crc;
-	part_entry part;
 	uint64_t last_table_lba;
-	uint32_t part_index = 0;
-	uint32_t max_index = 0;
 	
 	if(strncmp("EFI PART", hdr->signature, 8) != 0) { return NOT_GPT; }
 	wr(hdr->header_size < HDR_SZ || hdr->header_size > dev->lbsz, "illegal header size!", UNEXPECTED);
@@ -441,7 +1497,7 @@ int validate_header(gpt_hdr* hdr, gpt_dev* dev, uint64_t lba) {
 	if(hdr->header_size > HDR_SZ) {
 		calc_crc = crc32_zero(calc_crc, hdr->header_size - HDR_SZ);
 	}
-	wr(seekread_zero(dev->fd, (lba * dev->lbsz) + HDR_SZ, hdr->header_size - HDR_SZ) != 0, "reserved part of header not zero!", UNEXPECTED);
+	wr(seekread_zero(dev, (lba * dev->lbsz) + HDR_SZ, hdr->header_size - HDR_SZ) != 0, "reserved part of header not zero!", UNEXPECTED);
 	wr(calc_crc != reported_crc, "header integrity check failed!", CORRUPT);
 	hdr->crc = reported_crc;
 	wr(hdr->entry_size * hdr->ptable_entries < (16*1024), "partition table too small!", UNEXPECTED);
@@ -452,149 +1508,413 @@ int validate_header(gpt_hdr* hdr, gpt_dev* dev, uint64_t lba) {
 		return UNEXPECTED;
 	}
 
-	last_table_lba = hdr->ptable_lba + (((hdr->ptable_entries * hdr->entry_size) + dev->lbsz - 1) / dev->lbsz) - 1;
+	last_table_lba = hdr->ptable_lba + ptable_blocks(hdr, dev->lbsz) - 1;
 	wr(hdr->ptable_lba <= 1, "ptable inside primary header!", UNEXPECTED);
 	wr(last_table_lba >= dev->last_lba, "ptable runs into backup header!", UNEXPECTED);
 	wr(hdr->ptable_lba <= hdr->last_lba && hdr->ptable_lba >= hdr->first_lba, "ptable start inside partition space!", UNEXPECTED);
 	wr(last_table_lba <= hdr->last_lba && last_table_lba >= hdr->first_lba, "ptable end inside partition space!", UNEXPECTED);
 
-	// we need to iterate all partitions anyway, might as well record them into memory to avoid re-reading them
-	if(lba != 1) {
-		// dev->part_entries is assigned in the lba==1 pass
-		// should be the real amount of actual entries
-		if(dev->part_entries) {
-			if((dev->parts = malloc(dev->part_entries * sizeof(mpart))) == NULL) { fail("memfail"); }
-		}
-	}
+	return 0;
+}
 
-	calc_crc = 0;
-	// partition entries are all contiguous, so seek once and just continue reading
-	safeseek(dev->fd, hdr->ptable_lba * dev->lbsz);
-	for(int i = 0; i < hdr->ptable_entries; i++) {
-		saferead(dev->fd, &part, PART_SZ);
-		wr((part.attr & 0b0000000000000000111111111111111111111111111111111111111111111000)!= 0,
-		"unexpected partition attributes in reserved field!", UNEXPECTED);
-		calc_crc = crc32(calc_crc, &part, PART_SZ);
-		// each entry may be bigger than 128, but the extra space *must* be zeroed
-		if(hdr->entry_size > PART_SZ) {
-			calc_crc = crc32_zero(calc_crc, hdr->entry_size - PART_SZ);
-			wr(read_zero(dev->fd, hdr->entry_size - PART_SZ) != 0, "reserved portion of part entry not zero!", UNEXPECTED);
-		}
-
-		// while we are here take some metrics and copy table into memory
-		if(not_zero(part.type, 16)) {
-			// first pass on primary, just count how many entries there actually are
-			if(lba == 1) {
-				dev->part_entries++;
-				if(i > max_index) {
-					max_index = i;
-					// free space "index" may be up to 2 greater
-					dev->max_index_digits = max(dev->max_index_digits,digits(max_index+2));
-				}
-			} else if(part_index < dev->part_entries) {
-				// second pass on alt record them into memory
-				dev->parts[part_index].index = i;
-				memcpy(&(dev->parts[part_index].e), &part, PART_SZ);
-				part_index++;
-			} else {
-				warn("different amount of partitions in primary versus backup table!");
-				return UNEXPECTED;
-			}
-		// if not a real entry verify the entire entry is zero
-		} else if(not_zero((uint8_t*)&part, PART_SZ)){
-			warn("populated fields found in blank entry!");
-			return UNEXPECTED;
-		}
-	}
-	wr(calc_crc != hdr->ptable_crc, "corrupted partition table!", CORRUPT_PTABLE);
+// the rest of validation for a header that passed check_header
+// table is the fetch_ptable buffer for hdr, count is set to the number of populated entries
+int validate_table(gpt_hdr* hdr, gpt_dev* dev, uint64_t lba, uint8_t* table, uint32_t* count) {
+	int ret;
+
+	// passing check_header means fetch_ptable was able to read it
+	if((ret = validate_ptable(hdr, table, count)) != 0) { return ret; }
 
 	wr(hdr->this_lba != lba, "unexpected lba address!", UNEXPECTED);
 
 	return 0;
 }
 
+// take ownership of a raw table image laid out as described by hdr (or NULL to drop it)
+void adopt_ptable(gpt_dev* dev, gpt_hdr* hdr, uint8_t* table) {
+	free(dev->ptable);
+	free(dev->ptable_dirty);
+	free(dev->slot_crc);
+	dev->ptable = table;
+	dev->ptable_dirty = NULL;
+	dev->slot_crc = NULL;
+	dev->ptable_lb = 0;
+	if(table == NULL) { return; }
+
+	dev->ptable_lb = ptable_blocks(hdr, dev->lbsz);
+	if((dev->ptable_dirty = calloc(dev->ptable_lb, 1)) == NULL) { fail("memfail"); }
+	if((dev->slot_crc = calloc(hdr->ptable_entries, sizeof(uint32_t))) == NULL) { fail("memfail"); }
+}
+
+void free_parts(gpt_dev* dev) {
+	free(dev->pool);
+	free(dev->parts);
+	dev->pool = NULL;
+	dev->parts = NULL;
+	dev->part_entries = 0;
+}
+
 int cmp_start(const void* a_in, const void* b_in) {
-	const mpart* a = a_in;
-	const mpart* b = b_in;
+	const mpart* a = *(mpart* const*)a_in;
+	const mpart* b = *(mpart* const*)b_in;
 
 	if(a->e.start_lba < b->e.start_lba) { return -1; }
 	if(a->e.start_lba > b->e.start_lba) { return 1; }
 	return 0;
 }
 
-int check_overlap(gpt_dev* dev) {
-	uint64_t last_taken = 0;
-	// sort parts by starts on the disk
-	qsort(dev->parts, dev->part_entries, sizeof(mpart), cmp_start);
+// decode the populated entries of a validated table into dev->parts, keeping the table image
+void load_parts(gpt_dev* dev, gpt_hdr* hdr, uint8_t* table, uint32_t count) {
+	part_entry* part;
+	uint32_t max_index = 0;
 
-	for(uint32_t i = 0; i < dev->part_entries; i++) {
-		if(dev->parts[i].e.start_lba > dev->parts[i].e.end_lba) {
-			warn("start > end in partition %u!", dev->parts[i].index + 1);
-			return -1;
-		}
-		if(dev->parts[i].e.start_lba < dev->hdr.first_lba) {
-			warn("partition %u overlaps primary ptable and header area!", dev->parts[i].index + 1);
-			return -1;
+	adopt_ptable(dev, hdr, table);
+	// sized for a full table up front so edits never need to allocate
+	if((dev->pool = malloc(hdr->ptable_entries * sizeof(mpart))) == NULL) { fail("memfail"); }
+	if((dev->parts = malloc(hdr->ptable_entries * sizeof(mpart*))) == NULL) { fail("memfail"); }
+	dev->part_entries = 0;
+
+	for(uint32_t i = 0; i < hdr->ptable_entries; i++) {
+		part = (part_entry*)(table + ((size_t)i * hdr->entry_size));
+		if(!not_zero(part->type, 16)) {
+			dev->pool[i].index = UINT32_MAX;
+			continue;
 		}
-		if(dev->parts[i].e.end_lba > dev->hdr.last_lba) {
-			warn("partition %u overlaps backup ptable and header area!", dev->parts[i].index + 1);
-			return -1;
+		dev->pool[i].index = i;
+		memcpy(&(dev->pool[i].e), part, PART_SZ);
+		dev->slot_crc[i] = crc32_impl(0, (uint8_t*)part, PART_SZ);
+		dev->parts[dev->part_entries++] = &(dev->pool[i]);
+		max_index = i;
+	}
+	// free space "index" may be up to 2 greater
+	if(max_index > 0) {
+		dev->max_index_digits = max(dev->max_index_digits,digits(max_index+2));
+	}
+
+	// sort parts by starts on the disk, from here on edits keep them in order
+	qsort(dev->parts, dev->part_entries, sizeof(mpart*), cmp_start);
+}
+
+// position of a populated slot in dev->parts, looked up by its current start
+uint32_t part_pos(gpt_dev* dev, mpart* part) {
+	uint32_t lo = 0;
+	uint32_t hi = dev->part_entries;
+	uint32_t mid;
+
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(dev->parts[mid]->e.start_lba < part->e.start_lba) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
-		if(dev->parts[i].e.start_lba <= last_taken) {
-			warn("partition %u overlaps another partition!", dev->parts[i].index + 1);
-			return -1;
+	}
+	// step over any others with the same start
+	while(lo < dev->part_entries && dev->parts[lo] != part) { lo++; }
+	if(lo == dev->part_entries) { fail("lost track of partition %u!", part->index + 1); }
+	return lo;
+}
+
+// take a slot out of the start order, must be done before its start changes
+void order_remove(gpt_dev* dev, mpart* part) {
+	uint32_t pos = part_pos(dev, part);
+
+	memmove(&(dev->parts[pos]), &(dev->parts[pos + 1]), (dev->part_entries - pos - 1) * sizeof(mpart*));
+	dev->part_entries--;
+}
+
+// put a slot into the start order, after any with an equal start
+void order_insert(gpt_dev* dev, mpart* part) {
+	uint32_t lo = 0;
+	uint32_t hi = dev->part_entries;
+	uint32_t mid;
+
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(dev->parts[mid]->e.start_lba <= part->e.start_lba) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
+	}
+	memmove(&(dev->parts[lo + 1]), &(dev->parts[lo]), (dev->part_entries - lo) * sizeof(mpart*));
+	dev->parts[lo] = part;
+	dev->part_entries++;
+}
+
+// check a partition given the end of the one before it
+int check_range(gpt_dev* dev, mpart* part, uint64_t last_taken) {
+	if(part->e.start_lba > part->e.end_lba) {
+		warn("start > end in partition %u!", part->index + 1);
+		return -1;
+	}
+	if(part->e.start_lba < dev->hdr.first_lba) {
+		warn("partition %u overlaps primary ptable and header area!", part->index + 1);
+		return -1;
+	}
+	if(part->e.end_lba > dev->hdr.last_lba) {
+		warn("partition %u overlaps backup ptable and header area!", part->index + 1);
+		return -1;
+	}
+	if(part->e.start_lba <= last_taken) {
+		warn("partition %u overlaps another partition!", part->index + 1);
+		return -1;
+	}
+	return 0;
+}
+
+int check_overlap(gpt_dev* dev) {
+	uint64_t last_taken = 0;
+
+	dev->sane_parts = 0;
+	for(uint32_t i = 0; i < dev->part_entries; i++) {
+		if(check_range(dev, dev->parts[i], last_taken) != 0) { return -1; }
+		last_taken = dev->parts[i]->e.end_lba;
+	}
+
+	dev->sane_parts = 1;
+	return 0;
+}
+
+// after changing a single partition of a sane table only its neighbours can conflict with it
+int check_part(gpt_dev* dev, mpart* part) {
+	uint32_t pos;
+
+	if(!dev->sane_parts) { return check_overlap(dev); }
+
+	pos = part_pos(dev, part);
+	dev->sane_parts = 0;
+	if(check_range(dev, part, pos > 0 ? dev->parts[pos - 1]->e.end_lba : 0) != 0) { return -1; }
+	if(pos + 1 < dev->part_entries && check_range(dev, dev->parts[pos + 1], part->e.end_lba) != 0) { return -1; }
+	dev->sane_parts = 1;
+	return 0;
+}
+
+// a table that passed validation, good for as long as the disk and both headers are unchanged
+// the headers cover the table crc, so any edit through gpt or another tool misses the cache
+typedef struct __attribute__((packed)) {
+	char magic[8];
+	uint64_t disk_seq;
+	uint64_t last_lba;
+	uint32_t lbsz;
+	uint32_t count;
+	uint8_t hdr[HDR_SZ];
+	uint8_t alt[HDR_SZ];
+	uint64_t table_sz;
+	uint32_t crc;
+} table_cache;
+#define CACHE_MAGIC "GPTCACH1"
+
+void cache_path(gpt_dev* dev, char* path) {
+	int n = snprintf(path, PATH_MAX, "%s/", cache_dir);
+
+	// one flat file per device path
+	for(char* c = dev->device; *c && n < PATH_MAX - 1; c++) {
+		path[n++] = *c == '/' ? '_' : *c;
+	}
+	path[n] = 0;
+}
+
+// non-zero if there is nothing usable, otherwise the parts are loaded just as validation would have
+int cache_load(gpt_dev* dev) {
+	char path[PATH_MAX];
+	table_cache c;
+	uint8_t* table;
+	FILE* f;
+	uint32_t crc;
+	struct stat st;
+	int fd;
+
+	// without a disk sequence number a swapped disk or a rewritten image looks the same
+	if(cache_dir == NULL || dev->scrub || dev->disk_seq == 0) { return -1; }
+	cache_path(dev, path);
+	if((fd = open(path, O_RDONLY | O_NOFOLLOW)) == -1) { return -1; }
+	// a cached table is trusted in place of validation, so only one nobody else could have written
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		warn("ignoring cache %s, it is not a private file of this user", path);
+		close(fd);
+		return -1;
+	}
+	if((f = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		return -1;
+	}
+	if(fread(&c, sizeof(c), 1, f) != 1 || memcmp(c.magic, CACHE_MAGIC, 8) != 0 ||
+		c.disk_seq != dev->disk_seq || c.last_lba != dev->last_lba || c.lbsz != dev->lbsz ||
+		memcmp(c.hdr, &(dev->hdr), HDR_SZ) != 0 || memcmp(c.alt, &(dev->alt), HDR_SZ) != 0 ||
+		c.table_sz != ptable_blocks(&(dev->hdr), dev->lbsz) * dev->lbsz) {
+		fclose(f);
+		return -1;
+	}
+	if((table = malloc(c.table_sz)) == NULL) { fail("memfail"); }
+	crc = crc32(0, &c, offsetof(table_cache, crc));
+	if(fread(table, c.table_sz, 1, f) != 1 || crc32(crc, table, c.table_sz) != c.crc) {
+		fclose(f);
+		free(table);
+		return -1;
+	}
+	fclose(f);
+
+	load_parts(dev, &(dev->hdr), table, c.count);
+	if(check_overlap(dev) != 0) {
+		warn("Insane partition ranges detected! You should really fix this!");
+	}
+	return 0;
+}
 
-		last_taken = dev->parts[i].e.end_lba;
-	}
+// written aside and renamed over, so a reader never sees half of one
+void cache_save(gpt_dev* dev, uint32_t count) {
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 8];
+	table_cache c = { CACHE_MAGIC, dev->disk_seq, dev->last_lba, dev->lbsz, count };
+	FILE* f;
+	int ok;
+	int fd;
 
-	dev->sane_parts = 1;
-	return 0;
+	if(cache_dir == NULL || dev->disk_seq == 0) { return; }
+	memcpy(c.hdr, &(dev->hdr), HDR_SZ);
+	memcpy(c.alt, &(dev->alt), HDR_SZ);
+	c.table_sz = dev->ptable_lb * dev->lbsz;
+	c.crc = crc32(crc32(0, &c, offsetof(table_cache, crc)), dev->ptable, c.table_sz);
+
+	if(mkdir(cache_dir, 0700) != 0 && errno != EEXIST) {
+		warn("could not create cache %s", cache_dir);
+		return;
+	}
+	cache_path(dev, path);
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	// never through something already there, the directory may be shared
+	if((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600)) == -1) {
+		warn("could not write cache %s", tmp);
+		return;
+	}
+	if((f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		warn("could not write cache %s", tmp);
+		return;
+	}
+	ok = fwrite(&c, sizeof(c), 1, f) == 1 && fwrite(dev->ptable, c.table_sz, 1, f) == 1;
+	if(fclose(f) != 0 || !ok || rename(tmp, path) != 0) {
+		warn("could not write cache %s", path);
+		unlink(tmp);
+	}
 }
 
 // populate hdr and validate the device is actually GPT
 int check_device(gpt_dev* dev) {
 	int primary_ret;
 	int alt_ret;
-	uint32_t calc_crc;
+	uint32_t primary_count = 0;
+	uint32_t alt_count = 0;
+	uint8_t* primary_table;
+	ptable_fetch alt_fetch = { dev, &(dev->alt), NULL };
+	pthread_t alt_thread;
+	int threaded;
+	io_req reqs[2];
+	io_req batch[2];
+	int n;
+	int ret = VALID_GPT;
 
 	// reload ptable as a side effect
-	if(dev->parts != NULL) {
-		free(dev->parts);
-		dev->parts = NULL;
+	free_parts(dev);
+	adopt_ptable(dev, NULL, NULL);
+
+	if(cache_load(dev) == 0) { return VALID_GPT; }
+
+	primary_ret = check_header(&(dev->hdr), dev, 1);
+	alt_ret = check_header(&(dev->alt), dev, dev->last_lba);
+
+	// the backup table is normally a full stroke away from the primary, have both reads in flight at once
+	if(dev->io->read_batch) {
+		reqs[0] = reqs[1] = (io_req){0};
+		if(primary_ret == 0) { ptable_req(dev, &(dev->hdr), &reqs[0]); }
+		if(alt_ret == 0) { ptable_req(dev, &(dev->alt), &reqs[1]); }
+		// a broken header has nothing to read, the other still goes
+		n = 0;
+		for(int i = 0; i < 2; i++) {
+			if(reqs[i].iov[0].iov_base) { batch[n++] = reqs[i]; }
+		}
+		io_read_batch(dev, batch, n);
+		n = 0;
+		for(int i = 0; i < 2; i++) {
+			if(reqs[i].iov[0].iov_base) { reqs[i].result = batch[n++].result; }
+		}
+		primary_table = ptable_done(&(dev->hdr), &reqs[0]);
+		alt_fetch.table = ptable_done(&(dev->alt), &reqs[1]);
+	} else {
+		primary_table = NULL;
+		threaded = alt_ret == 0 && pthread_create(&alt_thread, NULL, fetch_ptable_thread, &alt_fetch) == 0;
+		if(primary_ret == 0) { primary_table = fetch_ptable(dev, &(dev->hdr)); }
+		if(threaded) {
+			pthread_join(alt_thread, NULL);
+		} else if(alt_ret == 0) {
+			fetch_ptable_thread(&alt_fetch);
+		}
 	}
-	dev->part_entries = 0;
 
-	primary_ret = validate_header(&(dev->hdr), dev, 1);
-	alt_ret = validate_header(&(dev->alt), dev, dev->last_lba);
+	if(primary_ret == 0) { primary_ret = validate_table(&(dev->hdr), dev, 1, primary_table, &primary_count); }
+	if(alt_ret == 0) { alt_ret = validate_table(&(dev->alt), dev, dev->last_lba, alt_fetch.table, &alt_count); }
 
 	if(primary_ret == NOT_GPT && alt_ret == NOT_GPT) {
-		return NOT_GPT;
-	}
-	if(primary_ret != 0 && alt_ret == 0) {
+		ret = NOT_GPT;
+	} else if(primary_ret != 0 && alt_ret == 0) {
 		warn("Primary GPT table is faulty. But the backup appears fine, maybe try restoring the primary?");
-		return primary_ret;
-	}
-	if(primary_ret == 0 && alt_ret != 0) {
+		load_parts(dev, &(dev->alt), alt_fetch.table, alt_count);
+		ret = primary_ret;
+	} else if(primary_ret == 0 && alt_ret != 0) {
 		warn("Backup GPT table is faulty. But the primary table appears fine, maybe try restoring the backup?");
-		return CORRUPT_BACKUP;
-	}
-	if(primary_ret != 0 && alt_ret != 0) {
+		load_parts(dev, &(dev->hdr), primary_table, primary_count);
+		ret = CORRUPT_BACKUP;
+	} else if(primary_ret != 0 && alt_ret != 0) {
 		warn("Both primary and backup tables are faulty!");
-		return primary_ret;
+		ret = primary_ret;
+	} else {
+		load_parts(dev, &(dev->hdr), primary_table, primary_count);
+		if(dev->hdr.alt_lba != dev->last_lba) {
+			warn("unexpected alt lba address in primary\n");
+			ret = UNEXPECTED;
+		} else if(dev->alt.alt_lba != 1) {
+			warn("unexpected alt lba address in alt\n");
+			ret = UNEXPECTED;
+		} else if(dev->alt.ptable_entries != dev->hdr.ptable_entries || dev->alt.entry_size != dev->hdr.entry_size ||
+			memcmp(primary_table, alt_fetch.table, (size_t)dev->hdr.ptable_entries * dev->hdr.entry_size) != 0) {
+			warn("backup table has different contents!\n");
+			ret = UNEXPECTED;
+		} else if(memcmp(dev->hdr.disk_guid, dev->alt.disk_guid, 16) != 0) {
+			warn("backup header has different identifier!\n");
+			ret = UNEXPECTED;
+		// Check for insane ranges but just warn so they can use tools to fix 
+		} else if(check_overlap(dev) != 0) {
+			warn("Insane partition ranges detected! You should really fix this!");
+		}
+		if(ret == VALID_GPT) {
+			cache_save(dev, primary_count);
+		}
 	}
 
-	wr(dev->hdr.alt_lba != dev->last_lba, "unexpected alt lba address in primary", UNEXPECTED);
-	wr(dev->alt.alt_lba != 1, "unexpected alt lba address in alt", UNEXPECTED);
-	wr(dev->alt.ptable_crc != dev->hdr.ptable_crc, "backup table has different contents!", UNEXPECTED);
-	wr(memcmp(dev->hdr.disk_guid, dev->alt.disk_guid, 16) != 0, "backup header has different identifier!", UNEXPECTED);
-	
-	// Check for insane ranges but just warn so they can use tools to fix 
-	if(check_overlap(dev) != 0) {
-		warn("Insane partition ranges detected! You should really fix this!");
-	}
+	if(primary_table != dev->ptable) { free(primary_table); }
+	if(alt_fetch.table != dev->ptable) { free(alt_fetch.table); }
+	return ret;
+}
 
-	return VALID_GPT;
+// read entire mbr, primary gpt header, and backup gpt header
+// none of these are necessarily valid at this point though
+// partitions are read into memory during validation
+// anything past the end of a file (an image about to be grown with -B) reads as zero
+void read_headers(gpt_dev* dev) {
+	io_req reqs[3] = {
+		{ 0, { { &(dev->m), MBR_SZ } } },
+		{ 1 * dev->lbsz, { { &(dev->hdr), HDR_SZ } } },
+		{ dev->last_lba * dev->lbsz, { { &(dev->alt), HDR_SZ } } },
+	};
+
+	io_read_batch(dev, reqs, 3);
+	if(reqs[0].result != MBR_SZ) { perror(""); fail("read failure!"); }
+	for(int i = 1; i < 3; i++) {
+		if(reqs[i].result == -1) { perror(""); fail("read failure!"); }
+		memset((uint8_t*)reqs[i].iov[0].iov_base + reqs[i].result, 0, HDR_SZ - reqs[i].result);
+	}
 }
 
 int open_device(char* device, gpt_dev* dev, int rflag)  {
@@ -628,25 +1948,28 @@ int open_device(char* device, gpt_dev* dev, int rflag)  {
 	dev->is_valid_gpt = UNCHECKED;
 	dev->sane_parts = 0;
 	dev->part_entries = 0;
+	dev->pool = NULL;
 	dev->parts = NULL;
+	dev->ptable = NULL;
+	dev->ptable_dirty = NULL;
+	dev->slot_crc = NULL;
+	dev->ptable_lb = 0;
 
 	strcpy(dev->device, device);
+	pthread_mutex_init(&dev->io_lock, NULL);
+	dev->io = NULL;
+	io_use(dev, io_default);
 
-	// read entire mbr, primary gpt header, and backup gpt header
-	// none of these are necessarily valid at this point though
-	// partitions are read into memory during validation
-	seekread(dev->fd, 0, &(dev->m), MBR_SZ);
-	seekread(dev->fd, (1 * dev->lbsz), &(dev->hdr), HDR_SZ);
-	seekread(dev->fd, (dev->last_lba * dev->lbsz), &(dev->alt), HDR_SZ);
+	read_headers(dev);
 
 	return 0;
 }
 
 void close_device(gpt_dev* dev) {
+	dev->io->teardown(dev);
 	close(dev->fd);
-	if(dev->parts != NULL) {
-		free(dev->parts);
-	}
+	free_parts(dev);
+	adopt_ptable(dev, NULL, NULL);
 }
 
 int validate_device(gpt_dev* dev) {
@@ -695,13 +2018,13 @@ void print_part(gpt_dev* dev, uint32_t num, part_entry* part) {
 	
 	uuid_str(type_uuid, part->type);
 	uuid_str(id_uuid, part->id);
-	c16tolocal(part->name, name);
+	c16tolocal(part->name, PARTNAME_CHARS, name);
 
 	bitstring(part->attr >> 48, 16, type_bits);
 	bitstring(part->attr, 3, cmn_bits);
 
 	// num uuid start end type type-attr common-attr label
-	wprintf(L"p|%0*u|%0*lu|%0*lu|%s|%s|%s|%s|%s\n",
+	fwprintf(OUT, L"p|%0*u|%0*lu|%0*lu|%s|%s|%s|%s|%s\n",
 		dev->max_index_digits, num,
 		dev->max_size_digits, part->start_lba,
 		dev->max_size_digits, part->end_lba,
@@ -715,24 +2038,266 @@ void print_part(gpt_dev* dev, uint32_t num, part_entry* part) {
 
 void print_free(gpt_dev* dev, uint32_t num, uint64_t start, uint64_t end) {
 	// num start end
-	wprintf(L"f|%03u|%0*lu|%0*lu\n",
+	fwprintf(OUT, L"f|%03u|%0*lu|%0*lu\n",
 		num,
 		dev->max_size_digits, start,
 		dev->max_size_digits, end
 	);
 }
 
+void rec_put(rec_buf* b, const void* data, size_t size) {
+	if(b->len + size > b->cap) {
+		b->cap = max(b->cap * 2, b->len + size + 4096);
+		if((b->data = realloc(b->data, b->cap)) == NULL) { fail("memfail"); }
+	}
+	memcpy(b->data + b->len, data, size);
+	b->len += size;
+}
+
+void rec_printf(rec_buf* b, const char* format, ...) {
+	char line[256];
+	va_list args;
+	int r;
+
+	va_start(args, format);
+	r = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if(r < 0 || r >= sizeof(line)) { fail("record too long!"); }
+	rec_put(b, line, r);
+}
+
+void rec_json_char(rec_buf* b, uint32_t c) {
+	char u[8];
+	int n;
+
+	if(c == '"' || c == '\\') {
+		u[0] = '\\';
+		u[1] = c;
+		n = 2;
+	} else if(c < 0x20) {
+		n = snprintf(u, sizeof(u), "\\u%04x", c);
+	} else {
+		n = utf8_put(u, c);
+	}
+	rec_put(b, u, n);
+}
+
+// bytes are passed through, so paths are assumed to be UTF-8 already
+void rec_json_str(rec_buf* b, const char* str) {
+	rec_put(b, "\"", 1);
+	for(; *str; str++) {
+		if((uint8_t)*str < 0x80) {
+			rec_json_char(b, *str);
+		} else {
+			rec_put(b, str, 1);
+		}
+	}
+	rec_put(b, "\"", 1);
+}
+
+// UTF-16 to UTF-8 directly, so the result doesn't depend on the locale
+void rec_json_c16(rec_buf* b, const char16_t* in, size_t len) {
+	uint32_t c;
+
+	rec_put(b, "\"", 1);
+	for(size_t i = 0; i < len && in[i] != u'\0'; i++) {
+		c = in[i];
+		if(c >= 0xd800 && c < 0xdc00 && i + 1 < len && in[i+1] >= 0xdc00 && in[i+1] < 0xe000) {
+			c = 0x10000 + ((c - 0xd800) << 10) + (in[++i] - 0xdc00);
+		} else if(c >= 0xd800 && c < 0xe000) {
+			// unpaired surrogate
+			c = 0xfffd;
+		}
+		rec_json_char(b, c);
+	}
+	rec_put(b, "\"", 1);
+}
+
+void rec_device(rec_buf* b, gpt_dev* dev) {
+	int valid = dev->is_valid_gpt == VALID_GPT;
+	char uuid[UUID_STR_SZ];
+	rec r = { .kind = 'd' };
+
+	if(out_format == FORMAT_BIN) {
+		r.d.seq = dev->disk_seq;
+		r.d.first_lba = valid ? dev->hdr.first_lba : 0;
+		r.d.last_lba = valid ? dev->hdr.last_lba : 0;
+		r.d.last_lb = dev->last_lba;
+		r.d.entries = valid ? dev->hdr.ptable_entries : 0;
+		r.d.lbsz = dev->lbsz;
+		r.d.heads = dev->geo.heads;
+		r.d.sectors = dev->geo.sectors;
+		r.d.cylinders = dev->geo.cylinders;
+		r.d.boot_crc = crc32(0, dev->m.boot_code, sizeof(dev->m.boot_code));
+		r.d.unknown = dev->m.unknown;
+		r.d.unique_sig = dev->m.unique_sig;
+		r.d.valid_gpt = valid;
+		if(valid) { memcpy(r.d.disk_guid, dev->hdr.disk_guid, 16); }
+		strncpy(r.d.path, dev->device, sizeof(r.d.path));
+		rec_put(b, &r, sizeof(r));
+		return;
+	}
+
+	rec_printf(b, "{\"record\":\"device\",\"path\":");
+	rec_json_str(b, dev->device);
+	rec_printf(b, ",\"seq\":%lu,\"gpt\":%s,\"first_lba\":%lu,\"last_lba\":%lu,\"last_lb\":%lu,\"entries\":%u,"
+		"\"lbsz\":%u,\"hpc\":%u,\"spt\":%u,\"cyls\":%u,\"boot_crc\":%u,\"unknown\":%u,\"disk_sig\":%u,\"disk_uuid\":",
+		dev->disk_seq,
+		valid ? "true" : "false",
+		valid ? dev->hdr.first_lba : 0,
+		valid ? dev->hdr.last_lba : 0,
+		dev->last_lba,
+		valid ? dev->hdr.ptable_entries : 0,
+		dev->lbsz,
+		dev->geo.heads,
+		dev->geo.sectors,
+		dev->geo.cylinders,
+		crc32(0, dev->m.boot_code, sizeof(dev->m.boot_code)),
+		dev->m.unknown,
+		dev->m.unique_sig
+	);
+	if(valid) {
+		uuid_str(uuid, dev->hdr.disk_guid);
+		rec_printf(b, "\"%s\"}\n", uuid);
+	} else {
+		rec_printf(b, "null}\n");
+	}
+}
+
+void rec_mbr(rec_buf* b, gpt_dev* dev, int i) {
+	chs start = mtochs(dev->m.part[i].start);
+	chs end = mtochs(dev->m.part[i].end);
+	rec r = { .kind = 'm', .num = i + 1 };
+
+	if(out_format == FORMAT_BIN) {
+		r.m.start_lba = dev->m.part[i].start_lba;
+		r.m.size_lba = dev->m.part[i].size_lba;
+		r.m.start = (rec_chs){ start.head, start.sector, start.cylinder };
+		r.m.end = (rec_chs){ end.head, end.sector, end.cylinder };
+		r.m.type = dev->m.part[i].type;
+		rec_put(b, &r, sizeof(r));
+		return;
+	}
+
+	rec_printf(b, "{\"record\":\"mbr\",\"num\":%u,\"start\":%u,\"size\":%u,"
+		"\"start_chs\":[%u,%u,%u],\"end_chs\":[%u,%u,%u],\"os\":%u}\n",
+		r.num,
+		dev->m.part[i].start_lba,
+		dev->m.part[i].size_lba,
+		start.head, start.sector, start.cylinder,
+		end.head, end.sector, end.cylinder,
+		dev->m.part[i].type
+	);
+}
+
+void rec_part(rec_buf* b, uint32_t num, part_entry* part) {
+	char type_uuid[UUID_STR_SZ];
+	char id_uuid[UUID_STR_SZ];
+	char16_t name[PARTNAME_CHARS];
+	const char* alias;
+	rec r = { .kind = 'p', .num = num };
+
+	if(out_format == FORMAT_BIN) {
+		r.p = *part;
+		rec_put(b, &r, sizeof(r));
+		return;
+	}
+
+	uuid_str(type_uuid, part->type);
+	uuid_str(id_uuid, part->id);
+	memcpy(name, part->name, sizeof(name));
+	// type attributes are the top 16 bits, keep the rest below 2^53 for json readers
+	rec_printf(b, "{\"record\":\"part\",\"num\":%u,\"start\":%lu,\"end\":%lu,\"type\":\"%s\",\"type_name\":",
+		num,
+		part->start_lba,
+		part->end_lba,
+		type_uuid
+	);
+	// aliases are plain ascii from gpt.ids
+	if((alias = type_name(part->type))) {
+		rec_printf(b, "\"%s\"", alias);
+	} else {
+		rec_printf(b, "null");
+	}
+	rec_printf(b, ",\"type_attr\":%u,\"attr\":%lu,\"uuid\":\"%s\",\"label\":",
+		(unsigned int)(part->attr >> 48),
+		part->attr & 0xffffffffffff,
+		id_uuid
+	);
+	rec_json_c16(b, name, PARTNAME_CHARS);
+	rec_printf(b, "}\n");
+}
+
+void rec_free(rec_buf* b, uint32_t num, uint64_t start, uint64_t end) {
+	rec r = { .kind = 'f', .num = num };
+
+	if(out_format == FORMAT_BIN) {
+		r.f.start_lba = start;
+		r.f.end_lba = end;
+		rec_put(b, &r, sizeof(r));
+		return;
+	}
+
+	rec_printf(b, "{\"record\":\"free\",\"num\":%u,\"start\":%lu,\"end\":%lu}\n", num, start, end);
+}
+
+// json or bin equivalent of print_device, nothing goes through the locale or stdio's wide stdout
+void print_records(gpt_dev* dev) {
+	rec_buf b = {0};
+
+	ensure_checked(dev);
+	rec_device(&b, dev);
+
+	if(dev->m.signature == 0xaa55) {
+		for(int i = 0; i < 4; i++) {
+			if(dev->m.part[i].type == 0x00) { continue; }
+			rec_mbr(&b, dev, i);
+		}
+	}
+
+	if(dev->part_entries) {
+		uint64_t chkfree = dev->hdr.first_lba;
+		uint32_t freenum = 1;
+
+		for(uint32_t i = 0; i < dev->part_entries; i++) {
+			if(dev->sane_parts) {
+				if(!(chkfree >= dev->parts[i]->e.start_lba && chkfree <= dev->parts[i]->e.end_lba)) {
+					rec_free(&b, freenum++, chkfree, dev->parts[i]->e.start_lba - 1);
+				}
+				chkfree = dev->parts[i]->e.end_lba + 1;
+			}
+			rec_part(&b, dev->parts[i]->index+1, &dev->parts[i]->e);
+		}
+		if(dev->sane_parts && chkfree <= dev->hdr.last_lba) {
+			rec_free(&b, freenum, chkfree, dev->hdr.last_lba);
+		}
+	}
+
+	// while scanning, tout is a byte stream collecting this device's records
+	if(tout) {
+		fwrite(b.data, 1, b.len, tout);
+	} else {
+		safewrite(STDOUT_FILENO, b.data, b.len);
+	}
+	free(b.data);
+}
+
 void print_device(gpt_dev* dev) {
 	int ret;
 	chs start;
 	chs end;
 	char uuid[UUID_STR_SZ];
 
+	if(out_format != FORMAT_TEXT) {
+		print_records(dev);
+		return;
+	}
+
 	// print separator breaks after first print
 	if(first_print) {
 		first_print = 0;
 	} else {
-		fprintf(stderr, "\n");
+		fprintf(ERR, "\n");
 	}
 
 	ensure_checked(dev);
@@ -741,7 +2306,7 @@ void print_device(gpt_dev* dev) {
 	}
 
 	// num range type attributes identifiers
-	fprintf(stderr,
+	fprintf(ERR,
 		"d|%-*s|%-*s|%-*s|%-*s|%-*s|lbsz|hpc|spt|cyls |boot crc|unkn|disksign|%-36s|path\n",
 		dev->max_index_digits, "seq",
 		dev->max_size_digits, "fst avl",
@@ -750,7 +2315,7 @@ void print_device(gpt_dev* dev) {
 		dev->is_valid_gpt == VALID_GPT ? digits(dev->hdr.ptable_entries) : 3, "max",
 		"diskuuid"
 	);
-	wprintf(L"d|%0*lu|%0*lu|%0*lu|%0*lu|%u|%04u|%03u|%03u|%05u|%08x|%04x|%08x|%s|%s\n",
+	fwprintf(OUT, L"d|%0*lu|%0*lu|%0*lu|%0*lu|%u|%04u|%03u|%03u|%05u|%08x|%04x|%08x|%s|%s\n",
 		dev->max_index_digits, dev->disk_seq,
 		dev->max_size_digits, dev->is_valid_gpt == VALID_GPT ? dev->hdr.first_lba : 0,
 		dev->max_size_digits, dev->is_valid_gpt == VALID_GPT ? dev->hdr.last_lba : 0,
@@ -773,7 +2338,7 @@ void print_device(gpt_dev* dev) {
 			dev->m.part[2].type ||
 			dev->m.part[3].type
 		)) {
-		fprintf(stderr,"m|num|%-*s|%-*s|shd|ss|scyl|ehd|es|ecyl|os\n",
+		fprintf(ERR,"m|num|%-*s|%-*s|shd|ss|scyl|ehd|es|ecyl|os\n",
 			dev->max_size_digits, "start",
 			dev->max_size_digits, "size"
 		);
@@ -781,7 +2346,7 @@ void print_device(gpt_dev* dev) {
 			if(dev->m.part[i].type == 0x00) { continue; }
 			start = mtochs(dev->m.part[i].start);
 			end = mtochs(dev->m.part[i].end);
-			wprintf(L"m|%0*u|%0*u|%0*u|%03u|%02u|%04u|%03u|%02u|%04u|%02x\n",
+			fwprintf(OUT, L"m|%0*u|%0*u|%0*u|%03u|%02u|%04u|%03u|%02u|%04u|%02x\n",
 				dev->max_index_digits, i + 1,
 				dev->max_size_digits, dev->m.part[i].start_lba,
 				dev->max_size_digits, dev->m.part[i].size_lba,
@@ -802,7 +2367,7 @@ void print_device(gpt_dev* dev) {
 		uint32_t freenum = 1;
 	
 		// num uuid start end common-attr type type-attr label
-		fprintf(stderr, "p|num|%-*s|%-*s|%-36s|type attributes |cmn|%-36s|partlabel\n",
+		fprintf(ERR, "p|num|%-*s|%-*s|%-36s|type attributes |cmn|%-36s|partlabel\n",
 			dev->max_size_digits, "start",
 			dev->max_size_digits, "end",
 			"typeuuid",
@@ -811,12 +2376,12 @@ void print_device(gpt_dev* dev) {
 		
 		for(uint32_t i = 0; i < dev->part_entries; i++) {
 			if(dev->sane_parts) {
-				if(!(chkfree >= dev->parts[i].e.start_lba && chkfree <= dev->parts[i].e.end_lba)) {
-					print_free(dev, freenum++, chkfree, dev->parts[i].e.start_lba - 1);
+				if(!(chkfree >= dev->parts[i]->e.start_lba && chkfree <= dev->parts[i]->e.end_lba)) {
+					print_free(dev, freenum++, chkfree, dev->parts[i]->e.start_lba - 1);
 				}
-				chkfree = dev->parts[i].e.end_lba + 1;
+				chkfree = dev->parts[i]->e.end_lba + 1;
 			}
-			print_part(dev, dev->parts[i].index+1, &dev->parts[i].e);
+			print_part(dev, dev->parts[i]->index+1, &dev->parts[i]->e);
 		}
 		if(dev->sane_parts && chkfree <= dev->hdr.last_lba) {
 			print_free(dev, freenum, chkfree, dev->hdr.last_lba);
@@ -824,33 +2389,592 @@ void print_device(gpt_dev* dev) {
 	}
 }
 
-void print_devices() {
-	FILE* parts;
-	unsigned int major;
-	unsigned int minor;
-	uint64_t blocks;
-	char name[NAME_MAX];
+// what -W last saw on a disk, an event is only emitted when some of it changes
+typedef struct {
+	char path[PATH_MAX];
+	uint64_t seq;
+	int status;
+	uint32_t hdr_crc;
+	uint32_t alt_crc;
+} watch_dev;
+
+// stderr text captured from one device scan, and where it falls in the stdout output
+// out_off counts wide chars of out for text, bytes of bin for -F json and bin
+typedef struct {
+	size_t out_off;
+	size_t len;
+	size_t cap;
+	char* text;
+} scan_seg;
+
+enum { SCAN_QUEUED, SCAN_RUNNING, SCAN_DONE, SCAN_ABANDONED };
+
+typedef struct {
+	char path[PATH_MAX];
+	int state;
+	int printed;
+	struct timespec started;
+	// the worker that took it, an abandoned one is never joined
+	pthread_t worker;
+	// stdout is wide so it is captured on its own, stderr is interleaved by offset
+	wchar_t* out;
+	size_t out_len;
+	// -F json and bin records, bytes
+	char* bin;
+	size_t bin_len;
+	scan_seg* segs;
+	size_t nsegs;
+	// -W probes keep what validation found instead of printing it
+	int scrub;
+	int gone;
+	watch_dev found;
+	// fail() ended it, what it printed up to then is still kept
+	int failed;
+} scan_job;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// scan_device when printing, watch_scan for -W
+	void (*run)(scan_job*);
+	scan_job* jobs;
+	size_t count;
+	size_t next;
+	// only touched by the thread running print_devices
+	pthread_t* workers;
+	size_t nworkers;
+} scan_pool;
+
+ssize_t scan_write_err(void* cookie, const char* buf, size_t size) {
+	scan_job* job = cookie;
+	scan_seg* seg = job->nsegs ? &job->segs[job->nsegs - 1] : NULL;
+	size_t out_off;
+	void* grown;
+
+	// bring out_len or bin_len up to date so this text is placed after everything printed so far
+	fflush(tout);
+	out_off = out_format == FORMAT_TEXT ? job->out_len : job->bin_len;
+	// fail() would write right back here, a text that can't be kept is a write error instead
+	if(seg == NULL || seg->out_off != out_off) {
+		if((grown = realloc(job->segs, (job->nsegs + 1) * sizeof(scan_seg))) == NULL) { return -1; }
+		job->segs = grown;
+		seg = &job->segs[job->nsegs++];
+		*seg = (scan_seg){ .out_off = out_off };
+	}
+	if(seg->len + size + 1 > seg->cap) {
+		if((grown = realloc(seg->text, max(seg->cap * 2, seg->len + size + 1))) == NULL) { return -1; }
+		seg->text = grown;
+		seg->cap = max(seg->cap * 2, seg->len + size + 1);
+	}
+	memcpy(seg->text + seg->len, buf, size);
+	seg->len += size;
+	seg->text[seg->len] = '\0';
+	return size;
+}
+
+// whatever a job had open when fail() ended it, which can be anywhere between open and close
+void drop_device(gpt_dev* dev) {
+	if(dev->io) {
+		close_device(dev);
+	} else if(dev->fd > 0) {
+		close(dev->fd);
+	}
+}
+
+void scan_device(scan_job* job) {
+	gpt_dev dev = {0};
+	jmp_buf failed;
+
+	if(out_format == FORMAT_TEXT) {
+		tout = open_wmemstream(&job->out, &job->out_len);
+	} else {
+		tout = open_memstream(&job->bin, &job->bin_len);
+	}
+	if(tout == NULL) {
+		job->failed = 1;
+		return;
+	}
+	if((terr = fopencookie(job, "w", (cookie_io_functions_t){ .write = scan_write_err })) == NULL) {
+		fclose(tout);
+		tout = NULL;
+		job->failed = 1;
+		return;
+	}
+	setvbuf(terr, NULL, _IONBF, 0);
+
+	// a fatal error lands in this job's capture and is printed in order with everything else
+	if(setjmp(failed) == 0) {
+		fail_jmp = &failed;
+		if(open_device(job->path, &dev, O_RDONLY) == 0) {
+			// separators are printed by print_devices as results are emitted
+			job->printed = 1;
+			validate_device(&dev);
+			first_print = 1;
+			print_device(&dev);
+			close_device(&dev);
+		}
+	} else {
+		job->failed = 1;
+		drop_device(&dev);
+	}
+	fail_jmp = NULL;
+
+	fclose(terr);
+	fclose(tout);
+	terr = NULL;
+	tout = NULL;
+}
+
+void* scan_worker(void* arg) {
+	scan_pool* pool = arg;
+	scan_job* job;
+
+	for(;;) {
+		pthread_mutex_lock(&pool->lock);
+		if(pool->next >= pool->count) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		job = &pool->jobs[pool->next++];
+		job->state = SCAN_RUNNING;
+		job->worker = pthread_self();
+		clock_gettime(CLOCK_MONOTONIC, &job->started);
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+
+		pool->run(job);
+
+		pthread_mutex_lock(&pool->lock);
+		if(job->state == SCAN_RUNNING) { job->state = SCAN_DONE; }
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+void start_scan_worker(scan_pool* pool) {
+	if((pool->workers = realloc(pool->workers, (pool->nworkers + 1) * sizeof(pthread_t))) == NULL) { fail("memfail"); }
+	if(pthread_create(&pool->workers[pool->nworkers], NULL, scan_worker, pool) != 0) { fail("could not start scan worker!"); }
+	pool->nworkers++;
+}
+
+// workers may outlive whoever started them if they get stuck, so a pool never lives on the stack
+scan_pool* new_scan_pool(void (*run)(scan_job*)) {
+	scan_pool* pool;
+	pthread_condattr_t attr;
+
+	if((pool = calloc(1, sizeof(scan_pool))) == NULL) { fail("memfail"); }
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pool->run = run;
+	return pool;
+}
+
+void add_scan_job(scan_pool* pool, const char* path) {
+	if((pool->jobs = realloc(pool->jobs, (pool->count + 1) * sizeof(scan_job))) == NULL) { fail("memfail"); }
+	pool->jobs[pool->count] = (scan_job){0};
+	strcpy(pool->jobs[pool->count].path, path);
+	pool->count++;
+}
+
+// non-zero if the job took longer than timeout seconds (0 waits forever) and was given up on
+int wait_scan_job(scan_pool* pool, scan_job* job, unsigned int timeout) {
+	struct timespec deadline;
+
+	pthread_mutex_lock(&pool->lock);
+	while(job->state == SCAN_QUEUED) {
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	}
+	deadline = job->started;
+	deadline.tv_sec += timeout;
+	while(job->state == SCAN_RUNNING) {
+		if(timeout == 0) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		} else if(pthread_cond_timedwait(&pool->cond, &pool->lock, &deadline) == ETIMEDOUT) {
+			job->state = SCAN_ABANDONED;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if(job->state != SCAN_ABANDONED) { return 0; }
+	warn("%s did not respond within %u seconds, skipping it", job->path, timeout);
+	return -1;
+}
+
+// wait for every worker that can still finish, then free the pool
+// a worker stuck in a read still holds the pool and its job, those are left to it
+void stop_scan_workers(scan_pool* pool) {
+	int stuck;
+	int abandoned = 0;
+
+	for(size_t w = 0; w < pool->nworkers; w++) {
+		stuck = 0;
+		for(size_t i = 0; i < pool->count; i++) {
+			if(pool->jobs[i].state == SCAN_ABANDONED && pthread_equal(pool->jobs[i].worker, pool->workers[w])) {
+				stuck = 1;
+			}
+		}
+		if(stuck) {
+			pthread_detach(pool->workers[w]);
+			abandoned = 1;
+		} else {
+			pthread_join(pool->workers[w], NULL);
+		}
+	}
+	if(abandoned) { return; }
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool->jobs);
+	free(pool);
+}
+
+FILE* open_disks() {
+	FILE* parts;
+	char line[NAME_MAX];
+
+	if((parts = fopen("/proc/partitions", "r")) == NULL) { fail("could not read /proc/partitions!"); }
+	// throw away header
+	fgets(line, NAME_MAX, parts);
+	fgets(line, NAME_MAX, parts);
+	return parts;
+}
+
+// next whole disk from /proc/partitions, partitions themselves have no /sys/block entry
+int next_disk(FILE* parts, char* path) {
+	unsigned int major;
+	unsigned int minor;
+	uint64_t blocks;
+	char name[NAME_MAX];
+	char sys[PATH_MAX];
+
+	while(!ferror(parts) && !feof(parts)) {
+		if(fscanf(parts, "%u %u %lu %s", &major, &minor, &blocks, name) == 4) {
+			snprintf(sys, PATH_MAX, "/sys/block/%s", name);
+			if(access(sys, F_OK) == 0) {
+				snprintf(path, PATH_MAX, "/dev/%s", name);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+// probe devices concurrently, print results in /proc/partitions order
+// devices that take longer than timeout seconds (0 waits forever) are skipped
+// the number of devices a fatal error cut short, the others are still printed
+int print_devices(unsigned int timeout) {
+	FILE* parts;
+	char path[PATH_MAX];
+	scan_pool* pool = new_scan_pool(scan_device);
+	int failed = 0;
+
+	parts = open_disks();
+	while(next_disk(parts, path)) {
+		add_scan_job(pool, path);
+	}
+	fclose(parts);
+
+	for(size_t i = 0; i < min(pool->count, SCAN_WORKERS); i++) {
+		start_scan_worker(pool);
+	}
+
+	for(size_t i = 0; i < pool->count; i++) {
+		scan_job* job = &pool->jobs[i];
+
+		if(wait_scan_job(pool, job, timeout) != 0) {
+			// a worker stuck in a read can't be interrupted, replace it to keep the pool size
+			start_scan_worker(pool);
+			continue;
+		}
+
+		if(job->printed) {
+			if(first_print) {
+				first_print = 0;
+			} else {
+				fprintf(stderr, "\n");
+			}
+		}
+		size_t done = 0;
+		for(size_t s = 0; s < job->nsegs; s++) {
+			if(job->out) {
+				fwprintf(stdout, L"%.*ls", (int)(job->segs[s].out_off - done), job->out + done);
+			} else if(job->bin) {
+				safewrite(STDOUT_FILENO, job->bin + done, job->segs[s].out_off - done);
+			}
+			done = job->segs[s].out_off;
+			fputs(job->segs[s].text, stderr);
+			free(job->segs[s].text);
+		}
+		if(job->out) {
+			fwprintf(stdout, L"%ls", job->out + done);
+		}
+		if(job->bin_len > done) {
+			safewrite(STDOUT_FILENO, job->bin + done, job->bin_len - done);
+		}
+		free(job->segs);
+		free(job->out);
+		free(job->bin);
+		if(job->failed) {
+			warn("%s could not be scanned, skipping the rest of it", job->path);
+			failed++;
+		}
+	}
+
+	stop_scan_workers(pool);
+	return failed;
+}
+
+double elapsed(struct timespec* since) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+typedef struct {
+	watch_dev* devs;
+	size_t count;
+	// next disk due for a scrub
+	size_t scrub;
+} watch_set;
+
+const char* status_name(int status) {
+	switch(status) {
+		case VALID_GPT: return "valid";
+		case NOT_GPT: return "not_gpt";
+		case UNEXPECTED: return "unexpected";
+		case CORRUPT: return "corrupt";
+		case CORRUPT_PTABLE: return "corrupt_ptable";
+		case CORRUPT_BACKUP: return "corrupt_backup";
+		default: return "unchecked";
+	}
+}
+
+void watch_emit(watch_dev* w, const char* event) {
+	rec_buf b = {0};
+	rec r = { .kind = 'e' };
+
+	if(out_format == FORMAT_TEXT) {
+		fwprintf(stdout, L"e|%-6s|%03lu|%-14s|%s\n", event, w->seq, status_name(w->status), w->path);
+		fflush(stdout);
+		return;
+	}
+	if(out_format == FORMAT_BIN) {
+		r.e.seq = w->seq;
+		r.e.status = w->status;
+		strncpy(r.e.event, event, sizeof(r.e.event) - 1);
+		strncpy(r.e.path, w->path, sizeof(r.e.path));
+		rec_put(&b, &r, sizeof(r));
+	} else {
+		rec_printf(&b, "{\"record\":\"event\",\"event\":\"%s\",\"path\":", event);
+		rec_json_str(&b, w->path);
+		rec_printf(&b, ",\"seq\":%lu,\"status\":\"%s\"}\n", w->seq, status_name(w->status));
+	}
+	safewrite(STDOUT_FILENO, b.data, b.len);
+	free(b.data);
+}
+
+watch_dev* watch_find(watch_set* set, const char* path) {
+	for(size_t i = 0; i < set->count; i++) {
+		if(strcmp(set->devs[i].path, path) == 0) { return &set->devs[i]; }
+	}
+	return NULL;
+}
+
+void watch_remove(watch_set* set, const char* path) {
+	watch_dev* w = watch_find(set, path);
+
+	if(w == NULL) { return; }
+	watch_emit(w, "remove");
+	*w = set->devs[--set->count];
+	if(set->scrub >= set->count) { set->scrub = 0; }
+}
+
+// validate a disk again, a scrub reads both tables even when the cache (-K) would vouch for them
+// runs on a scan worker, so a disk that hangs holds up only its own probe
+void watch_scan(scan_job* job) {
+	gpt_dev dev = {0};
+	char cache[PATH_MAX];
+	uint64_t size = 0;
+	int fd;
+	jmp_buf failed;
+
+	// a drive with no media or a detached loop device keeps its node, but has nothing to read
+	if((fd = open(job->path, O_RDONLY)) != -1) {
+		ioctl(fd, BLKGETSIZE64, &size);
+		close(fd);
+	}
+	if(setjmp(failed) != 0) {
+		fail_jmp = NULL;
+		job->failed = 1;
+		drop_device(&dev);
+		return;
+	}
+	fail_jmp = &failed;
+	if(size == 0 || open_device(job->path, &dev, O_RDONLY) != 0) {
+		fail_jmp = NULL;
+		job->gone = 1;
+		return;
+	}
+	dev.scrub = job->scrub;
+	validate_device(&dev);
+	fail_jmp = NULL;
+	// a cached result the scrub contradicts would be trusted again by the next probe
+	if(dev.scrub && dev.is_valid_gpt != VALID_GPT && cache_dir != NULL) {
+		cache_path(&dev, cache);
+		unlink(cache);
+	}
+
+	strcpy(job->found.path, job->path);
+	job->found.seq = dev.disk_seq;
+	job->found.status = dev.is_valid_gpt;
+	job->found.hdr_crc = crc32(0, &(dev.hdr), HDR_SZ);
+	job->found.alt_crc = crc32(0, &(dev.alt), HDR_SZ);
+	close_device(&dev);
+}
+
+// a disk that takes longer than timeout seconds (0 waits forever) keeps what was last seen of it
+void watch_probe(watch_set* set, const char* path, int scrub, unsigned int timeout) {
+	scan_pool* pool = new_scan_pool(watch_scan);
+	watch_dev* w;
+	watch_dev now;
+	const char* event = NULL;
+	int gone;
+
+	add_scan_job(pool, path);
+	pool->jobs[0].scrub = scrub;
+	start_scan_worker(pool);
+	// a disk that hung or failed to read is left as it was last seen
+	if(wait_scan_job(pool, &pool->jobs[0], timeout) != 0 || pool->jobs[0].failed) {
+		stop_scan_workers(pool);
+		return;
+	}
+	gone = pool->jobs[0].gone;
+	now = pool->jobs[0].found;
+	stop_scan_workers(pool);
+
+	if(gone) {
+		watch_remove(set, path);
+		return;
+	}
+
+	w = watch_find(set, path);
+	if(w == NULL) {
+		if((set->devs = realloc(set->devs, (set->count + 1) * sizeof(watch_dev))) == NULL) { fail("memfail"); }
+		w = &set->devs[set->count++];
+		event = "add";
+	} else if(w->seq != now.seq) {
+		// new media or a re-attached loop device, nothing about the old table carries over
+		event = "reset";
+	} else if(w->status != now.status || w->hdr_crc != now.hdr_crc || w->alt_crc != now.alt_crc) {
+		event = "change";
+	}
+	*w = now;
+	if(event) { watch_emit(w, event); }
+}
+
+// handle one kernel uevent, only whole disks matter
+void watch_uevent(watch_set* set, char* msg, ssize_t len, unsigned int timeout) {
+	char* action = NULL;
+	char* subsystem = NULL;
+	char* devtype = NULL;
+	char* devname = NULL;
+	char path[PATH_MAX];
+
+	// "action@devpath" then KEY=VALUE strings, all null terminated
+	for(char* p = msg; p < msg + len; p += strlen(p) + 1) {
+		if(strncmp(p, "ACTION=", 7) == 0) { action = p + 7; }
+		else if(strncmp(p, "SUBSYSTEM=", 10) == 0) { subsystem = p + 10; }
+		else if(strncmp(p, "DEVTYPE=", 8) == 0) { devtype = p + 8; }
+		else if(strncmp(p, "DEVNAME=", 8) == 0) { devname = p + 8; }
+	}
+	if(action == NULL || devname == NULL || subsystem == NULL || devtype == NULL) { return; }
+	if(strcmp(subsystem, "block") != 0 || strcmp(devtype, "disk") != 0) { return; }
+
+	snprintf(path, PATH_MAX, "/dev/%s", devname);
+	if(strcmp(action, "remove") == 0) {
+		watch_remove(set, path);
+	} else if(strcmp(action, "add") == 0 || strcmp(action, "change") == 0) {
+		watch_probe(set, path, 0, timeout);
+	}
+}
+
+// -W: validate every disk once, then again only when the kernel reports it added, changed, or reset
+// one disk is scrubbed every scrub seconds (0 never), reading both tables whatever the cache says
+// each probe gets timeout seconds, as in print_devices
+void watch_devices(unsigned int scrub, unsigned int timeout) {
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+	struct sockaddr_nl from;
+	socklen_t from_len;
+	struct pollfd pfd;
+	struct timespec next_scrub;
+	char msg[8192];
 	char path[PATH_MAX];
-	
-	gpt_dev dev = {0};
+	watch_set set = {0};
+	FILE* parts;
+	ssize_t len;
+	int wait;
 
-	if((parts = fopen("/proc/partitions", "r")) == NULL) { fail("could not read /proc/partitions!"); }
-	// throw away header
-	fgets(name, NAME_MAX, parts);
-	fgets(name, NAME_MAX, parts);
+	// subscribe before the first pass so nothing that happens during it is missed
+	if((pfd.fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT)) == -1) {
+		perror("");
+		fail("could not open uevent socket!");
+	}
+	if(bind(pfd.fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		perror("");
+		fail("could not listen for uevents!");
+	}
+	pfd.events = POLLIN;
 
-	while(!ferror(parts) && !feof(parts)) {
-		if(fscanf(parts, "%u %u %lu %s", &major, &minor, &blocks, name) == 4) {
-			snprintf(path, PATH_MAX, "/sys/block/%s", name);
-			if(access(path, F_OK) == 0) {
-				snprintf(path, PATH_MAX, "/dev/%s", name);
-				if(open_device(path, &dev, O_RDONLY) != 0) {
-					continue;
+	parts = open_disks();
+	while(next_disk(parts, path)) {
+		watch_probe(&set, path, 0, timeout);
+	}
+	fclose(parts);
+
+	clock_gettime(CLOCK_MONOTONIC, &next_scrub);
+	next_scrub.tv_sec += scrub;
+	for(;;) {
+		wait = -1;
+		if(scrub) {
+			wait = max(0, (int)(elapsed(&next_scrub) * -1000));
+		}
+		if(poll(&pfd, 1, wait) == -1) {
+			if(errno == EINTR) { continue; }
+			perror("");
+			fail("poll failure!");
+		}
+		if(pfd.revents & POLLIN) {
+			from_len = sizeof(from);
+			len = recvfrom(pfd.fd, msg, sizeof(msg) - 1, 0, (struct sockaddr*)&from, &from_len);
+			if(len == -1) {
+				// ENOBUFS means events were dropped, every disk has to be looked at again
+				if(errno != ENOBUFS) { continue; }
+				warn("uevents were lost, revalidating all disks");
+				parts = open_disks();
+				while(next_disk(parts, path)) {
+					watch_probe(&set, path, 0, timeout);
 				}
-				validate_device(&dev);
-				print_device(&dev);
-				close_device(&dev);
+				fclose(parts);
+				continue;
 			}
+			// only the kernel is trusted to report devices
+			if(from.nl_pid != 0) { continue; }
+			msg[len] = '\0';
+			watch_uevent(&set, msg, len, timeout);
+		}
+		if(scrub && elapsed(&next_scrub) >= 0) {
+			if(set.count) {
+				strcpy(path, set.devs[set.scrub].path);
+				set.scrub = (set.scrub + 1) % set.count;
+				watch_probe(&set, path, 1, timeout);
+			}
+			// after a suspend or a slow scrub, don't catch up with a burst
+			clock_gettime(CLOCK_MONOTONIC, &next_scrub);
+			next_scrub.tv_sec += scrub;
 		}
 	}
 }
@@ -880,7 +3004,11 @@ void write_mbr(gpt_dev* dev) {
 	dev->m.part[0].end = chstom(end);
 	dev->m.signature = 0xaa55;
 
-	seekwrite(dev->fd, 0, &(dev->m), MBR_SZ);
+	if(dev->staging) {
+		dev->mbr_pending = 1;
+		return;
+	}
+	seekwrite(dev, 0, &(dev->m), MBR_SZ);
 }
 
 // recalculate crc for header
@@ -895,35 +3023,177 @@ void calc_hdr(gpt_hdr* hdr) {
 	hdr->crc = calc_crc;
 }
 
-// recalculate ptable crc and return the value
-uint32_t calc_ptable(gpt_dev* dev) {
-	uint32_t calc_crc = 0;
-	int p;
+// update one slot of the in-memory table image, NULL blanks it
+// the ptable crc is kept current without summing the whole table again
+void put_slot(gpt_dev* dev, uint32_t num, part_entry* e) {
+	uint64_t offset = (uint64_t)num * dev->hdr.entry_size;
+	uint32_t crc = e != NULL ? crc32_impl(0, (uint8_t*)e, PART_SZ) : 0;
+
+	// crc is linear: the new table crc is the old one xor the crc of the change,
+	// and the change is just this slot's difference shifted past every byte that follows it
+	if(crc != dev->slot_crc[num]) {
+		dev->hdr.ptable_crc ^= crc32_multmodp(
+			crc32_x2nmodp(((uint64_t)(dev->hdr.ptable_entries - num) * dev->hdr.entry_size) - PART_SZ, 3),
+			crc ^ dev->slot_crc[num]);
+		dev->slot_crc[num] = crc;
+	}
+
+	if(e != NULL) {
+		memcpy(dev->ptable + offset, e, PART_SZ);
+	} else {
+		memset(dev->ptable + offset, 0, PART_SZ);
+	}
+	for(uint64_t b = offset / dev->lbsz; b <= (offset + PART_SZ - 1) / dev->lbsz; b++) {
+		dev->ptable_dirty[b] = 1;
+	}
+}
 
-	for(int i = 0; i < dev->hdr.ptable_entries; i++) {
-		for(p = 0; p < dev->part_entries; p++) {
-			if(dev->parts[p].index == i) { break; }
-		}
-		if(p < dev->part_entries) {
-			calc_crc = crc32(calc_crc, &(dev->parts[p].e), PART_SZ);
+// the writes for the dirty blocks of the table image and then the header block for one copy of the table
+// runs of dirty blocks go out as single writes, and the header joins the last one if it is adjacent
+// hblock must be a zeroed block that lives until the writes are done, returns the number of reqs
+int table_copy_reqs(gpt_dev* dev, gpt_hdr* hdr, uint8_t* hblock, io_req* reqs) {
+	io_req* req = reqs;
+	uint64_t first;
+	uint64_t last;
+	uint64_t end;
+	int n;
+	// the backup header sits after its table, the primary header before it
+	int hdr_after = hdr->this_lba > hdr->ptable_lba;
+
+	memcpy(hblock, hdr, HDR_SZ);
+
+	// walk away from the header so the run next to it (if any) is written last
+	for(uint64_t i = 0; i < dev->ptable_lb; i++) {
+		end = hdr_after ? i : dev->ptable_lb - 1 - i;
+		if(!dev->ptable_dirty[end]) { continue; }
+		first = last = end;
+		if(hdr_after) {
+			while(last + 1 < dev->ptable_lb && dev->ptable_dirty[last + 1]) { last++; }
 		} else {
-			calc_crc = crc32_zero(calc_crc, PART_SZ);
+			while(first > 0 && dev->ptable_dirty[first - 1]) { first--; }
+		}
+		i += last - first;
+
+		n = 0;
+		if(!hdr_after && first == 0 && hdr->ptable_lba == hdr->this_lba + 1) {
+			req->iov[n].iov_base = hblock;
+			req->iov[n++].iov_len = dev->lbsz;
 		}
-		if(dev->hdr.entry_size > PART_SZ) {
-			calc_crc = crc32_zero(calc_crc, dev->hdr.entry_size - PART_SZ);
+		req->iov[n].iov_base = dev->ptable + (first * dev->lbsz);
+		req->iov[n++].iov_len = (last - first + 1) * dev->lbsz;
+		if(hdr_after && last == dev->ptable_lb - 1 && hdr->ptable_lba + dev->ptable_lb == hdr->this_lba) {
+			req->iov[n].iov_base = hblock;
+			req->iov[n++].iov_len = dev->lbsz;
+		}
+		req->offset = ((hdr->ptable_lba + first) - (n == 2 && !hdr_after)) * dev->lbsz;
+		req->iovcnt = n;
+		req++;
+		if(n == 2) {
+			return req - reqs;
 		}
 	}
-	
-	return calc_crc;
+
+	*req++ = (io_req){ hdr->this_lba * dev->lbsz, { { hblock, dev->lbsz } }, 1 };
+	return req - reqs;
+}
+
+// zero long runs of blank dirty blocks on the device and leave the rest to be written
+// only for whole copies (-g -f -l), flush_ptable has to keep the backup ahead of the primary
+void zero_table_runs(gpt_dev* dev, gpt_hdr* hdr) {
+	uint64_t last;
+
+	for(uint64_t first = 0; first < dev->ptable_lb; first = last + 1) {
+		last = first;
+		while(last < dev->ptable_lb && dev->ptable_dirty[last] && !not_zero(dev->ptable + last * dev->lbsz, dev->lbsz)) {
+			last++;
+		}
+		if((last - first) * dev->lbsz >= ZERO_MIN) {
+			seekwrite_zero(dev, (hdr->ptable_lba + first) * dev->lbsz, (last - first) * dev->lbsz);
+			memset(dev->ptable_dirty + first, 0, last - first);
+		}
+	}
+}
+
+void write_table_copy(gpt_dev* dev, gpt_hdr* hdr) {
+	uint8_t* hblock;
+	io_req* reqs;
+
+	zero_table_runs(dev, hdr);
+	if((hblock = calloc(1, dev->lbsz)) == NULL) { fail("memfail"); }
+	if((reqs = malloc((dev->ptable_lb + 1) * sizeof(io_req))) == NULL) { fail("memfail"); }
+	io_write_batch(dev, reqs, table_copy_reqs(dev, hdr, hblock, reqs));
+	free(reqs);
+	free(hblock);
+}
+
+// write changed table blocks and both headers, backup first then the primary
+// with a barrier between them the backup is on disk before the primary is touched
+void flush_ptable(gpt_dev* dev) {
+	uint8_t* hblocks;
+	io_req* reqs;
+	int n;
+
+	if((hblocks = calloc(2, dev->lbsz)) == NULL) { fail("memfail"); }
+	if((reqs = malloc((2 * dev->ptable_lb + 3) * sizeof(io_req))) == NULL) { fail("memfail"); }
+	n = table_copy_reqs(dev, &(dev->alt), hblocks, reqs);
+	reqs[n++] = (io_req){0};
+	n += table_copy_reqs(dev, &(dev->hdr), hblocks + dev->lbsz, reqs + n);
+	io_write_batch(dev, reqs, n);
+	memset(dev->ptable_dirty, 0, dev->ptable_lb);
+	free(reqs);
+	free(hblocks);
+}
+
+// recalculate crcs and write the changed table out, or hold it back while staging
+void commit_table(gpt_dev* dev) {
+	if(dev->staging) {
+		dev->table_pending = 1;
+		return;
+	}
+
+	// put_slot already brought the primary's crc up to date
+	dev->alt.ptable_crc = dev->hdr.ptable_crc;
+	calc_hdr(&(dev->alt));
+	calc_hdr(&(dev->hdr));
+
+	// write to backup first, then the primary
+	flush_ptable(dev);
+}
+
+// write everything held back since -S, if it all still makes sense
+void commit_staged(gpt_dev* dev) {
+	dev->staging = 0;
+	if(dev->table_pending && check_overlap(dev) != 0) {
+		fail("staged partition ranges are not sane! nothing was written");
+	}
+	if(dev->mbr_pending) {
+		dev->mbr_pending = 0;
+		seekwrite(dev, 0, &(dev->m), MBR_SZ);
+	}
+	if(dev->table_pending) {
+		dev->table_pending = 0;
+		commit_table(dev);
+	}
+	fprintf(stderr, "wrote staged changes\n");
+}
+
+// commands that rebuild tables straight from disk can't be mixed with staged edits
+void ensure_unstaged(gpt_dev* dev) {
+	if(dev->staging) {
+		fail("can't build or restore tables while staging! commit with -C first");
+	}
 }
 
 // copy from backup to primary
 void restore_primary(gpt_dev* dev) {
-	int table_sz_lb; // in blocks
-	part_entry part;
-	
-	if(validate_header(&(dev->alt), dev, dev->last_lba) != 0) { fail("there is a problem with the backup header!"); }
-	table_sz_lb = ((dev->alt.ptable_entries * dev->alt.entry_size) + dev->lbsz - 1) / dev->lbsz;
+	uint64_t table_sz_lb; // in blocks
+	uint8_t* table;
+	uint32_t count;
+
+	if(check_header(&(dev->alt), dev, dev->last_lba) != 0) { fail("there is a problem with the backup header!"); }
+	table = fetch_ptable(dev, &(dev->alt));
+	if(validate_table(&(dev->alt), dev, dev->last_lba, table, &count) != 0) { fail("there is a problem with the backup header!"); }
+	table_sz_lb = ptable_blocks(&(dev->alt), dev->lbsz);
 
 	memcpy(&(dev->hdr), &(dev->alt), HDR_SZ);
 	dev->hdr.this_lba = 1;
@@ -934,11 +3204,10 @@ void restore_primary(gpt_dev* dev) {
 	}
 	calc_hdr(&(dev->hdr));
 
-	for(int i = 0; i < dev->alt.ptable_entries; i++) {
-		seekread(dev->fd, (dev->alt.ptable_lba * dev->lbsz) + (i * dev->alt.entry_size), &part, PART_SZ);
-		seekwrite(dev->fd, (dev->hdr.ptable_lba * dev->lbsz) + (i * dev->hdr.entry_size), &part, PART_SZ);
-	}
-	seekwrite(dev->fd, 1 * dev->lbsz, &(dev->hdr), HDR_SZ);
+	// the table is copied over whole, so every block is written
+	adopt_ptable(dev, &(dev->alt), table);
+	memset(dev->ptable_dirty, 1, dev->ptable_lb);
+	write_table_copy(dev, &(dev->hdr));
 
 	fprintf(stderr, "copied backup table to primary\n");
 	validate_device(dev);
@@ -947,11 +3216,14 @@ void restore_primary(gpt_dev* dev) {
 
 // copy from primary to backup
 void restore_backup(gpt_dev* dev) {
-	int table_sz_lb; // in blocks
-	part_entry part;
+	uint64_t table_sz_lb; // in blocks
+	uint8_t* table;
+	uint32_t count;
 
-	if(validate_header(&(dev->hdr), dev, 1) != 0) { fail("there is a problem with the primary header!"); }
-	table_sz_lb = ((dev->hdr.ptable_entries * dev->hdr.entry_size) + dev->lbsz - 1) / dev->lbsz;
+	if(check_header(&(dev->hdr), dev, 1) != 0) { fail("there is a problem with the primary header!"); }
+	table = fetch_ptable(dev, &(dev->hdr));
+	if(validate_table(&(dev->hdr), dev, 1, table, &count) != 0) { fail("there is a problem with the primary header!"); }
+	table_sz_lb = ptable_blocks(&(dev->hdr), dev->lbsz);
 
 	memcpy(&(dev->alt), &(dev->hdr), HDR_SZ);
 	dev->alt.this_lba = dev->last_lba;
@@ -962,11 +3234,9 @@ void restore_backup(gpt_dev* dev) {
 	}
 	calc_hdr(&(dev->alt));
 
-	for(int i = 0; i < dev->hdr.ptable_entries; i++) {
-		seekread(dev->fd, (dev->hdr.ptable_lba * dev->lbsz) + (i * dev->hdr.entry_size), &part, PART_SZ);
-		seekwrite(dev->fd, (dev->alt.ptable_lba * dev->lbsz) + (i * dev->alt.entry_size), &part, PART_SZ);
-	}
-	seekwrite(dev->fd, dev->last_lba * dev->lbsz, &(dev->alt), HDR_SZ);
+	adopt_ptable(dev, &(dev->hdr), table);
+	memset(dev->ptable_dirty, 1, dev->ptable_lb);
+	write_table_copy(dev, &(dev->alt));
 
 	fprintf(stderr, "copied primary table to backup\n");
 	validate_device(dev);
@@ -974,7 +3244,8 @@ void restore_backup(gpt_dev* dev) {
 
 void write_gpt(gpt_dev* dev) {
 	gpt_hdr h = {0};
-	int table_sz_lb; // in blocks
+	uint64_t table_sz_lb; // in blocks
+	uint8_t* table;
 
 	strncpy(h.signature,"EFI PART", 8); // size prevents null terminator, that's okay
 	h.revision_major = 1;
@@ -993,7 +3264,7 @@ void write_gpt(gpt_dev* dev) {
 	// must be enough so that the table is at least 16KiB large
 	h.ptable_entries = dev->max_entries; // normally 128
 	// normally 32 (128*128/512==32)
-	table_sz_lb = ((h.ptable_entries * h.entry_size) + dev->lbsz - 1) / dev->lbsz;
+	table_sz_lb = ptable_blocks(&h, dev->lbsz);
 
 	// req: ptable_lba > 1 and ptable_lba < first_lba - and likewise reversed for alt
 	// which implies you can add as much "padding" as you want before and after both tables
@@ -1016,8 +3287,11 @@ void write_gpt(gpt_dev* dev) {
 	calc_hdr(&h);
 	memcpy(&(dev->alt), &h, HDR_SZ);
 
-	seekwrite_zero(dev->fd, h.ptable_lba * dev->lbsz, h.ptable_entries * h.entry_size);
-	seekwrite(dev->fd, dev->last_lba * dev->lbsz, &h, HDR_SZ);
+	// blank table image, written whole along with the backup header
+	if((table = calloc(table_sz_lb, dev->lbsz)) == NULL) { fail("memfail"); }
+	adopt_ptable(dev, &h, table);
+	memset(dev->ptable_dirty, 1, dev->ptable_lb);
+	write_table_copy(dev, &(dev->alt));
 
 	// includes validation which repopulates memory partition table
 	restore_primary(dev);
@@ -1035,36 +3309,33 @@ void relabel_gpt(gpt_dev* dev) {
 	}
 	memcpy(dev->alt.disk_guid, dev->hdr.disk_guid, 16);
 
-	calc_hdr(&(dev->alt));
-	calc_hdr(&(dev->hdr));
-
-	seekwrite(dev->fd, dev->last_lba * dev->lbsz, &(dev->alt), HDR_SZ);
-	seekwrite(dev->fd, 1 * dev->lbsz,             &(dev->hdr), HDR_SZ);
+	// nothing in the table changed, so only the header blocks are written
+	commit_table(dev);
 }
 
 int guess_free(gpt_dev* dev, uint64_t* start, uint64_t* end) {
 	uint64_t chkfree = dev->hdr.first_lba;
 	uint32_t freenum = 1;
 
-	if(dev->parts != NULL && !dev->sane_parts) { return -1; }
+	if(dev->part_entries && !dev->sane_parts) { return -1; }
 	
-	for(uint32_t i = 0; dev->parts != NULL && i < dev->part_entries; i++) {
-		if(!(chkfree >= dev->parts[i].e.start_lba && chkfree <= dev->parts[i].e.end_lba)) {
+	for(uint32_t i = 0; i < dev->part_entries; i++) {
+		if(!(chkfree >= dev->parts[i]->e.start_lba && chkfree <= dev->parts[i]->e.end_lba)) {
 			if(!*start && !*end) {
 				*start = chkfree;
-				*end = dev->parts[i].e.start_lba - 1;
+				*end = dev->parts[i]->e.start_lba - 1;
 				return 0;
 			}
-			if(*start && *start >= chkfree && *start < dev->parts[i].e.start_lba) {
-				*end = dev->parts[i].e.start_lba - 1;
+			if(*start && *start >= chkfree && *start < dev->parts[i]->e.start_lba) {
+				*end = dev->parts[i]->e.start_lba - 1;
 				return 0;
 			}
-			if(*end && *end >= chkfree && *end < dev->parts[i].e.start_lba) {
+			if(*end && *end >= chkfree && *end < dev->parts[i]->e.start_lba) {
 				*start = chkfree;
 				return 0;
 			}
 		}
-		chkfree = dev->parts[i].e.end_lba + 1;
+		chkfree = dev->parts[i]->e.end_lba + 1;
 	}
 	if(chkfree <= dev->hdr.last_lba) {
 		if(!*start && !*end) {
@@ -1087,16 +3358,10 @@ int guess_free(gpt_dev* dev, uint64_t* start, uint64_t* end) {
 
 // get a part by num in memory if existing
 int find_part(gpt_dev* dev, uint32_t num, mpart** out) {
-	if(dev->parts == NULL || !dev->sane_parts) { return -1; }
-
-	for(uint32_t i = 0; i < dev->part_entries; i++) {
-		if(dev->parts[i].index == num) {
-			*out = &(dev->parts[i]);
-			return 0;
-		}
-	}
+	if(dev->pool == NULL || num >= dev->hdr.ptable_entries || dev->pool[num].index != num) { return -1; }
 
-	return -1;
+	*out = &(dev->pool[num]);
+	return 0;
 }
 
 void set_entry(gpt_dev* dev, uint32_t num,
@@ -1107,7 +3372,7 @@ void set_entry(gpt_dev* dev, uint32_t num,
 	
 	ensure_valid(dev);
 	
-	if(num < 1 || num >= dev->alt.ptable_entries) { fail("entry does not exist!"); }
+	if(num < 1 || num > dev->alt.ptable_entries) { fail("entry does not exist!"); }
 	// zero index
 	num = num - 1;
 
@@ -1125,18 +3390,20 @@ void set_entry(gpt_dev* dev, uint32_t num,
 			if(guess_free(dev, &start_lba, &end_lba) < 0) { fail("could not find an appropriate free range!"); }
 		}
 
-		// create new partition in memory
-		if((dev->parts = realloc(dev->parts, (++dev->part_entries) * sizeof(mpart))) == NULL) { fail("memfail"); }
-		part = &dev->parts[dev->part_entries-1];
+		// create new partition in its slot
+		part = &(dev->pool[num]);
 		part->index = num;
 		memset(&(part->e), 0, PART_SZ);
+	} else {
+		order_remove(dev, part);
 	}
 	
 	if(start_lba) { part->e.start_lba = start_lba; }
 	if(end_lba) { part->e.end_lba = end_lba; }
 
-	// re-sort and warn if there are still problems
-	check_overlap(dev);
+	// keep start order and warn if there are still problems
+	order_insert(dev, part);
+	check_part(dev, part);
 	
 	// if '+' generate always
 	// if NULL generate only if not existing
@@ -1153,10 +3420,9 @@ void set_entry(gpt_dev* dev, uint32_t num,
 	}
 
 	if(typeid != NULL && typeid[0] != '-') {
-		parse_uuid(typeid, part->e.type);
+		parse_type(typeid, part->e.type);
 	} else if(!not_zero(part->e.type, 16)) {
-		// linux-generic type as default. technically this parse is an avoidable performance hit. TODO maybe.
-		parse_uuid("0fc63daf-8483-4772-8e79-3d69d8477de4", part->e.type);
+		memcpy(part->e.type, type_linux_generic, 16);
 	}
 
 	if(typeattr != NULL) {
@@ -1186,17 +3452,10 @@ void set_entry(gpt_dev* dev, uint32_t num,
 		localtoc16(label, part->e.name, PARTNAME_CHARS);
 	}
 	
-	dev->alt.ptable_crc = dev->hdr.ptable_crc = calc_ptable(dev);
-	calc_hdr(&(dev->alt));
-	calc_hdr(&(dev->hdr));
+	put_slot(dev, num, &(part->e));
+	commit_table(dev);
 
-	// write to backup first, then the primary
-	seekwrite(dev->fd, (dev->alt.ptable_lba * dev->lbsz) + (num * dev->alt.entry_size), &(part->e), PART_SZ);
-	seekwrite(dev->fd, dev->last_lba * dev->lbsz, &(dev->alt), HDR_SZ);
-	seekwrite(dev->fd, (dev->hdr.ptable_lba * dev->lbsz) + (num * dev->hdr.entry_size), &(part->e), PART_SZ);
-	seekwrite(dev->fd, 1 * dev->lbsz,             &(dev->hdr), HDR_SZ);
-
-	fprintf(stderr, "wrote partition entry %u\n", num + 1);
+	fprintf(stderr, "%swrote partition entry %u\n", dev->staging ? "(staged) " : "", num + 1);
 }
 
 void del_entry(gpt_dev* dev, uint32_t num) {
@@ -1210,28 +3469,44 @@ void del_entry(gpt_dev* dev, uint32_t num) {
 	if(find_part(dev, num, &part) != 0) {
 		fail("could not find partition!");
 	}
-	if(dev->part_entries - 1 != 0) {
-		// hacky. move partition to the end of the table and remove it
-		part->e.start_lba = UINT64_MAX;
-		qsort(dev->parts, dev->part_entries, sizeof(mpart), cmp_start);
-		if((dev->parts = realloc(dev->parts, (--dev->part_entries) * sizeof(mpart))) == NULL) { fail("memfail"); }
-	} else {
-		dev->part_entries = 0;
-		free(dev->parts);
-		dev->parts = NULL;
+	order_remove(dev, part);
+	part->index = UINT32_MAX;
+	memset(&(part->e), 0, PART_SZ);
+	// removing one can only fix an insane table, never break a sane one
+	if(!dev->sane_parts) {
+		check_overlap(dev);
 	}
 
-	dev->alt.ptable_crc = dev->hdr.ptable_crc = calc_ptable(dev);
-	calc_hdr(&(dev->alt));
-	calc_hdr(&(dev->hdr));
+	put_slot(dev, num, NULL);
+	commit_table(dev);
 
-	// write to backup first, then the primary
-	seekwrite_zero(dev->fd, (dev->alt.ptable_lba * dev->lbsz) + (num * dev->alt.entry_size), PART_SZ);
-	seekwrite(dev->fd, dev->last_lba * dev->lbsz, &(dev->alt), HDR_SZ);
-	seekwrite_zero(dev->fd, (dev->hdr.ptable_lba * dev->lbsz) + (num * dev->hdr.entry_size), PART_SZ);
-	seekwrite(dev->fd, 1 * dev->lbsz,             &(dev->hdr), HDR_SZ);
+	fprintf(stderr, "%sdeleted partition entry %u\n", dev->staging ? "(staged) " : "", num + 1);
+}
+
+// change where a partition lives and nothing else about it, a '-' START keeps the start and a '-' END keeps the size
+// unlike -s a range that doesn't fit is refused
+void relocate_entry(gpt_dev* dev, uint32_t num, char* start, char* end) {
+	mpart* part;
+	uint64_t size;
+
+	ensure_valid(dev);
+
+	if(num < 1 || num > dev->alt.ptable_entries) { fail("entry does not exist!"); }
+	// zero index
+	num = num - 1;
+	if(find_part(dev, num, &part) != 0) { fail("could not find partition!"); }
+
+	size = part->e.end_lba - part->e.start_lba;
+	order_remove(dev, part);
+	if(start[0] != '-') { part->e.start_lba = strtoull(start, NULL, 10); }
+	part->e.end_lba = end[0] != '-' ? strtoull(end, NULL, 10) : part->e.start_lba + size;
+	order_insert(dev, part);
+	if(check_part(dev, part) != 0) { fail("partition %u can't be placed at %lu-%lu!", num + 1, part->e.start_lba, part->e.end_lba); }
+
+	put_slot(dev, num, &(part->e));
+	commit_table(dev);
 
-	fprintf(stderr, "deleted partition entry %u\n", num + 1);
+	fprintf(stderr, "%srelocated partition entry %u to %lu-%lu\n", dev->staging ? "(staged) " : "", num + 1, part->e.start_lba, part->e.end_lba);
 }
 
 void move_entry(gpt_dev* dev, uint32_t a, uint32_t b) {
@@ -1239,34 +3514,715 @@ void move_entry(gpt_dev* dev, uint32_t a, uint32_t b) {
 	
 	ensure_valid(dev);
 	a = a - 1; b = b - 1;
+	if(b >= dev->hdr.ptable_entries) { fail("entry does not exist!"); }
 	if(find_part(dev, b, &part) == 0) { fail("B entry exists!"); }
 	if(find_part(dev, a, &part) != 0) { fail("could not find partition!"); }
-	part->index = b;
 
-	dev->alt.ptable_crc = dev->hdr.ptable_crc = calc_ptable(dev);
-	calc_hdr(&(dev->alt));
-	calc_hdr(&(dev->hdr));
+	// same start, so it keeps its place in the order
+	dev->parts[part_pos(dev, part)] = &(dev->pool[b]);
+	dev->pool[b] = *part;
+	dev->pool[b].index = b;
+	part->index = UINT32_MAX;
+	memset(&(part->e), 0, PART_SZ);
+	part = &(dev->pool[b]);
+
+	put_slot(dev, b, &(part->e));
+	put_slot(dev, a, NULL);
+	commit_table(dev);
+
+	fprintf(stderr, "%smoved partition entry %u to %u\n", dev->staging ? "(staged) " : "", a+1, b+1);
+}
+
+// a -D checkpoint, the journal file holds two so a torn write leaves the other one intact
+typedef struct __attribute__((packed)) {
+	char magic[8];
+	uint64_t seq;
+	uint64_t src;
+	uint64_t dst;
+	uint64_t count;
+	uint32_t lbsz;
+	uint32_t chunk;
+	uint8_t disk_guid[16];
+	// chunks in hand out order that are on the device
+	uint64_t done;
+	// the allocation map (-A) follows the two slots, the source may be half overwritten on a resume
+	uint64_t map_base;
+	uint64_t map_unit;
+	uint64_t map_units;
+	uint32_t map_crc;
+	uint32_t crc;
+} copy_ckpt;
+#define CKPT_SLOT 512
+#define CKPT_MAGIC "GPTCOPY2"
+
+// which parts of a range need copying, in units of unit bytes from base
+// anything before base or past the last unit is always copied
+typedef struct {
+	uint64_t base;
+	uint64_t unit;
+	uint64_t units;
+	uint8_t* bits;
+} alloc_map;
+
+uint64_t getle(const uint8_t* p, int n) {
+	uint64_t v = 0;
+	while(n--) { v = (v << 8) | p[n]; }
+	return v;
+}
+
+int alloc_used(alloc_map* map, uint64_t unit) {
+	return getbit(map->bits[unit / 8], unit % 8);
+}
+
+// the next range at or after *pos and before end that has to be copied, zero if there is none
+int alloc_next(alloc_map* map, uint64_t* pos, uint64_t* len, uint64_t end) {
+	uint64_t map_end = map->base + map->units * map->unit;
+	uint64_t p = *pos;
+	uint64_t q;
+
+	while(p < end && p >= map->base && p < map_end && !alloc_used(map, (p - map->base) / map->unit)) {
+		p = map->base + ((p - map->base) / map->unit + 1) * map->unit;
+	}
+	if(p >= end) { return 0; }
+	q = p;
+	while(q < end) {
+		if(q < map->base) {
+			q = map->base;
+		} else if(q >= map_end) {
+			q = end;
+		} else if(alloc_used(map, (q - map->base) / map->unit)) {
+			q = map->base + ((q - map->base) / map->unit + 1) * map->unit;
+		} else {
+			break;
+		}
+	}
+	*pos = p;
+	*len = min(q, end) - p;
+	return 1;
+}
+
+void alloc_mark(alloc_map* map, uint64_t unit, uint64_t count) {
+	for(uint64_t u = unit; u < min(unit + count, map->units); u++) {
+		setbit(map->bits[u / 8], u % 8, 1);
+	}
+}
+
+// whether an ext group holds a superblock and descriptor backup
+int ext_has_backup(uint8_t* sb, uint64_t g) {
+	uint64_t n;
+
+	// sparse_super2 names its two backups
+	if(getle(sb + 0x5C, 4) & 0x200) {
+		return g == 0 || g == getle(sb + 0x24C, 4) || g == getle(sb + 0x250, 4);
+	}
+	if(!(getle(sb + 0x64, 4) & 0x1) || g <= 1) { return 1; }
+	for(int p = 3; p <= 7; p += 2) {
+		for(n = p; n < g; n *= p);
+		if(n == g) { return 1; }
+	}
+	return 0;
+}
+
+// ext2/3/4, the block bitmap of every group
+// groups whose bitmap was never initialized (BLOCK_UNINIT) only hold their superblock backup and
+// group metadata, which is marked from the descriptors the same way the kernel builds their bitmap
+int alloc_map_ext(gpt_dev* dev, off_t at, alloc_map* map) {
+	uint8_t sb[1024];
+	uint8_t* gdt;
+	uint8_t* bitmaps;
+	io_req reqs[64];
+	uint64_t bs, blocks, first, bpg, groups, incompat, desc, start, n, block, gdt_blocks, itable_blocks;
+	uint8_t* gd;
+	int batch;
+
+	seekread(dev, at + 1024, sb, sizeof(sb));
+	if(getle(sb + 0x38, 2) != 0xEF53) { return -1; }
+	incompat = getle(sb + 0x60, 4);
+	bs = 1024ULL << getle(sb + 0x18, 4);
+	first = getle(sb + 0x14, 4);
+	bpg = getle(sb + 0x20, 4);
+	blocks = getle(sb + 0x4, 4) | ((incompat & 0x80) ? getle(sb + 0x150, 4) << 32 : 0);
+	desc = (incompat & 0x80) ? max(getle(sb + 0xFE, 2), 32) : 32;
+	// meta_bg scatters the descriptors around the filesystem
+	wr(incompat & 0x10, "ext meta_bg is not supported for -A", -1);
+	wr(bs > 65536 || bpg == 0 || bpg > bs * 8 || blocks <= first, "ext superblock does not make sense", -1);
+	groups = (blocks - first + bpg - 1) / bpg;
+	gdt_blocks = (groups * desc + bs - 1) / bs + getle(sb + 0xCE, 2);
+	// revision 0 has fixed 128 byte inodes
+	itable_blocks = (getle(sb + 0x28, 4) * (getle(sb + 0x4C, 4) ? getle(sb + 0x58, 2) : 128) + bs - 1) / bs;
+
+	if((gdt = malloc(groups * desc)) == NULL) { fail("memfail"); }
+	if((bitmaps = malloc(64 * bs)) == NULL) { fail("memfail"); }
+	map->base = 0;
+	map->unit = bs;
+	map->units = blocks;
+	if((map->bits = calloc((blocks + 7) / 8, 1)) == NULL) { fail("memfail"); }
+	seekread(dev, at + (first + 1) * bs, gdt, groups * desc);
+
+	// blocks before the first group (the boot block with 1k blocks)
+	alloc_mark(map, 0, first);
+
+	for(uint64_t g = 0; g < groups; g += batch) {
+		batch = min(groups - g, 64);
+		for(int i = 0; i < batch; i++) {
+			gd = gdt + (g + i) * desc;
+			// bitmaps and inode tables, wherever flex_bg put them
+			alloc_mark(map, getle(gd, 4) | (desc >= 64 ? getle(gd + 0x20, 4) << 32 : 0), 1);
+			alloc_mark(map, getle(gd + 0x4, 4) | (desc >= 64 ? getle(gd + 0x24, 4) << 32 : 0), 1);
+			alloc_mark(map, getle(gd + 0x8, 4) | (desc >= 64 ? getle(gd + 0x28, 4) << 32 : 0), itable_blocks);
+
+			block = getle(gd, 4) | (desc >= 64 ? getle(gd + 0x20, 4) << 32 : 0);
+			reqs[i] = (io_req){ at + block * bs, { { bitmaps + i * bs, bs } }, 1 };
+			if(getle(gd + 0x12, 2) & 0x2) {
+				reqs[i].iov[0].iov_len = 0;
+				if(ext_has_backup(sb, g + i)) {
+					alloc_mark(map, first + (g + i) * bpg, 1 + gdt_blocks);
+				}
+			}
+		}
+		io_read_batch(dev, reqs, batch);
+		for(int i = 0; i < batch; i++) {
+			if(reqs[i].iov[0].iov_len == 0) { continue; }
+			if(reqs[i].result != bs) { perror(""); fail("read failure!"); }
+			start = first + (g + i) * bpg;
+			n = min(bpg, blocks - start);
+			for(uint64_t b = 0; b < n; b++) {
+				if(getbit(bitmaps[i * bs + b / 8], b % 8)) {
+					setbit(map->bits[(start + b) / 8], (start + b) % 8, 1);
+				}
+			}
+		}
+	}
+	free(bitmaps);
+	free(gdt);
+	return 0;
+}
+
+// FAT32, every cluster with a non-zero FAT entry, the reserved sectors and FATs are always copied
+int alloc_map_fat(gpt_dev* dev, off_t at, alloc_map* map) {
+	uint8_t boot[512];
+	uint8_t* fat;
+	uint64_t bps, spc, rsv, nfats, total, fatsz, n;
+
+	seekread(dev, at, boot, sizeof(boot));
+	if(memcmp(boot + 0x52, "FAT32   ", 8) != 0) { return -1; }
+	bps = getle(boot + 0x0B, 2);
+	spc = boot[0x0D];
+	rsv = getle(boot + 0x0E, 2);
+	nfats = boot[0x10];
+	total = getle(boot + 0x13, 2) ? getle(boot + 0x13, 2) : getle(boot + 0x20, 4);
+	fatsz = getle(boot + 0x24, 4);
+	wr(bps < 512 || (bps & (bps - 1)) || spc == 0 || (spc & (spc - 1)) || nfats == 0 || fatsz == 0 ||
+		rsv + nfats * fatsz >= total, "FAT32 boot sector does not make sense", -1);
+
+	map->base = (rsv + nfats * fatsz) * bps;
+	map->unit = spc * bps;
+	map->units = min((total - rsv - nfats * fatsz) / spc, (fatsz * bps / 4) - 2);
+	if((map->bits = calloc((map->units + 7) / 8, 1)) == NULL) { fail("memfail"); }
+	if((fat = malloc(COPY_CHUNK)) == NULL) { fail("memfail"); }
+
+	// entries 0 and 1 are reserved, cluster c is entry c + 2
+	for(uint64_t c = 0; c < map->units; c += n) {
+		n = min(map->units - c, COPY_CHUNK / 4);
+		seekread(dev, at + rsv * bps + (c + 2) * 4, fat, n * 4);
+		for(uint64_t i = 0; i < n; i++) {
+			if(getle(fat + i * 4, 4) & 0x0FFFFFFF) { setbit(map->bits[(c + i) / 8], (c + i) % 8, 1); }
+		}
+	}
+	free(fat);
+	return 0;
+}
+
+// NTFS, the $Bitmap file (MFT record 6), which covers all of its own metadata too
+int alloc_map_ntfs(gpt_dev* dev, off_t at, alloc_map* map) {
+	uint8_t boot[512];
+	uint8_t* rec;
+	uint8_t* attr;
+	uint8_t* run;
+	uint64_t bps, spc, cs, total, mft, recsz, usa, usa_count, clusters, len, bytes;
+	int64_t lcn = 0;
+	uint64_t vcn = 0;
+	int8_t v;
+	int ls, os;
+	char* broken = NULL;
+
+	seekread(dev, at, boot, sizeof(boot));
+	if(memcmp(boot + 3, "NTFS    ", 8) != 0) { return -1; }
+	bps = getle(boot + 0x0B, 2);
+	spc = boot[0x0D] > 128 ? 1ULL << (256 - boot[0x0D]) : boot[0x0D];
+	cs = bps * spc;
+	total = getle(boot + 0x28, 8);
+	mft = getle(boot + 0x30, 8);
+	v = boot[0x40];
+	recsz = v < 0 ? 1ULL << -v : v * cs;
+	wr(bps < 512 || (bps & (bps - 1)) || spc == 0 || recsz < 512 || recsz > 65536 || total < spc, "NTFS boot sector does not make sense", -1);
+	clusters = total / spc;
+	bytes = (clusters + 7) / 8;
+
+	if((rec = malloc(recsz)) == NULL) { fail("memfail"); }
+	seekread(dev, at + mft * cs + 6 * recsz, rec, recsz);
+	usa = getle(rec + 0x04, 2);
+	usa_count = getle(rec + 0x06, 2);
+	if(memcmp(rec, "FILE", 4) != 0 || usa_count != recsz / 512 + 1 || usa + usa_count * 2 > recsz) {
+		broken = "record is not readable";
+		goto done;
+	}
+	// the last two bytes of every sector were swapped out for the update sequence number
+	for(uint64_t i = 1; i < usa_count; i++) {
+		if(memcmp(rec + i * 512 - 2, rec + usa, 2) != 0) {
+			broken = "record is torn";
+			goto done;
+		}
+		memcpy(rec + i * 512 - 2, rec + usa + i * 2, 2);
+	}
+
+	// the non resident unnamed $DATA attribute
+	attr = rec + getle(rec + 0x14, 2);
+	while(attr + 8 <= rec + recsz && getle(attr, 4) != 0xFFFFFFFF) {
+		if(getle(attr, 4) == 0x80 && attr[8] && attr[9] == 0) { break; }
+		if(getle(attr + 4, 4) == 0) { break; }
+		attr += getle(attr + 4, 4);
+	}
+	if(attr + 0x40 > rec + recsz || getle(attr, 4) != 0x80 || !attr[8]) {
+		broken = "has no data";
+		goto done;
+	}
+	if(getle(attr + 0x30, 8) < bytes) {
+		broken = "is too small for the volume";
+		goto done;
+	}
+
+	map->base = 0;
+	map->unit = cs;
+	map->units = clusters;
+	if((map->bits = calloc(bytes, 1)) == NULL) { fail("memfail"); }
+	// runs are (length, relative lcn) pairs with the size of each in the header nibbles
+	run = attr + getle(attr + 0x20, 2);
+	while(run < rec + recsz && *run && vcn * cs < bytes) {
+		ls = *run & 0xF;
+		os = *run >> 4;
+		if(run + 1 + ls + os > rec + recsz || ls == 0) { break; }
+		len = getle(run + 1, ls);
+		if(os) {
+			// sign extend
+			lcn += (int64_t)(getle(run + 1 + ls, os) << (64 - os * 8)) >> (64 - os * 8);
+			seekread(dev, at + lcn * cs, map->bits + vcn * cs, min(len * cs, bytes - vcn * cs));
+		}
+		vcn += len;
+		run += 1 + ls + os;
+	}
+	if(vcn * cs < bytes) {
+		broken = "runs are incomplete";
+	}
+done:
+	free(rec);
+	if(broken) {
+		free(map->bits);
+		map->bits = NULL;
+		warn("NTFS $Bitmap %s", broken);
+		return -1;
+	}
+	return 0;
+}
+
+// NULL if the source isn't a filesystem we know how to read, then everything is copied
+alloc_map* alloc_map_read(gpt_dev* dev, off_t at) {
+	alloc_map* map;
+
+	if((map = calloc(1, sizeof(alloc_map))) == NULL) { fail("memfail"); }
+	if(alloc_map_ext(dev, at, map) == 0 || alloc_map_fat(dev, at, map) == 0 || alloc_map_ntfs(dev, at, map) == 0) {
+		return map;
+	}
+	free(map);
+	return NULL;
+}
+
+// a data copy shared by its workers, chunks are handed out in order from the end the copy moves away from
+// so source and destination may overlap: chunk i is only written once every chunk its destination
+// could cover has been read, which is every chunk up to i - lag
+// with a journal those chunks must also be written and checkpointed, so a resume always finds its source intact
+typedef struct {
+	gpt_dev* dev;
+	off_t src;
+	off_t dst;
+	uint64_t len;
+	uint64_t chunk;
+	uint64_t chunks;
+	uint64_t lag;
+	int backward;
+	int use_cfr;
+	// -A, NULL copies everything
+	alloc_map* map;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t next;
+	// per chunk, 1 once read and 2 once written, the prefixes only count chunks in order
+	uint8_t* state;
+	uint64_t read_prefix;
+	uint64_t written_prefix;
+	// bytes of the range done, and bytes actually moved
+	uint64_t done;
+	uint64_t copied;
+	int running;
+	// journal only, written_prefix as of the last checkpoint, and whether a worker is waiting on one
+	int journal;
+	copy_ckpt ckpt;
+	uint64_t durable;
+	int want_ckpt;
+} copy_job;
+
+// byte offset into the range and length of the i'th chunk handed out
+void copy_chunk(copy_job* job, uint64_t i, uint64_t* off, uint64_t* len) {
+	uint64_t end;
+
+	if(job->backward) {
+		end = job->len - (i * job->chunk);
+		*off = end > job->chunk ? end - job->chunk : 0;
+		*len = end - *off;
+	} else {
+		*off = i * job->chunk;
+		*len = min(job->chunk, job->len - *off);
+	}
+}
+
+// call with the lock held
+void copy_wait_source(copy_job* job, uint64_t i) {
+	while(i >= job->lag && (job->journal ? job->durable : job->read_prefix) <= i - job->lag) {
+		if(job->journal && !job->want_ckpt) {
+			job->want_ckpt = 1;
+			pthread_cond_broadcast(&job->cond);
+		}
+		pthread_cond_wait(&job->cond, &job->lock);
+	}
+}
+
+// call with the lock held
+void copy_mark(copy_job* job, uint64_t i, uint8_t state) {
+	job->state[i] = state;
+	while(job->read_prefix < job->chunks && job->state[job->read_prefix] >= 1) {
+		job->read_prefix++;
+	}
+	while(job->written_prefix < job->chunks && job->state[job->written_prefix] >= 2) {
+		job->written_prefix++;
+	}
+	pthread_cond_broadcast(&job->cond);
+}
+
+// non-zero if the kernel won't do it, the chunk is left for a buffered copy
+int copy_chunk_cfr(copy_job* job, uint64_t off, uint64_t len) {
+	loff_t in = job->src + off;
+	loff_t out = job->dst + off;
+	ssize_t r;
+
+	while(len) {
+		if((r = copy_file_range(job->dev->fd, &in, job->dev->fd, &out, len, 0)) <= 0) {
+			if(r == 0 || errno == EINVAL || errno == EXDEV || errno == EOPNOTSUPP || errno == ENOSYS) { return -1; }
+			perror("");
+			fail("copy failure!");
+		}
+		len -= r;
+	}
+	return 0;
+}
+
+// the next run of a chunk that needs copying, everything if there is no allocation map
+int copy_next_run(copy_job* job, uint64_t* pos, uint64_t* len, uint64_t end) {
+	if(job->map) { return alloc_next(job->map, pos, len, end); }
+	if(*pos >= end) { return 0; }
+	*len = end - *pos;
+	return 1;
+}
+
+void* copy_worker(void* arg) {
+	copy_job* job = arg;
+	uint8_t* buf = NULL;
+	uint64_t i;
+	uint64_t off;
+	uint64_t len;
+	uint64_t pos;
+	uint64_t run;
+	uint64_t copied;
+	int fallback;
+
+	pthread_mutex_lock(&job->lock);
+	while((i = job->next) < job->chunks) {
+		job->next++;
+		copy_chunk(job, i, &off, &len);
+		copied = 0;
+
+		// the kernel reads and writes in one go, so the wait for earlier reads comes first
+		if(job->use_cfr) {
+			copy_wait_source(job, i);
+			pthread_mutex_unlock(&job->lock);
+			fallback = 0;
+			for(pos = off; !fallback && copy_next_run(job, &pos, &run, off + len); pos += run) {
+				fallback = copy_chunk_cfr(job, pos, run) != 0;
+				copied += fallback ? 0 : run;
+			}
+			pthread_mutex_lock(&job->lock);
+			if(!fallback) {
+				copy_mark(job, i, 2);
+				job->done += len;
+				job->copied += copied;
+				continue;
+			}
+			job->use_cfr = 0;
+		}
+		pthread_mutex_unlock(&job->lock);
+
+		// runs that already went through the kernel are simply copied again
+		copied = 0;
+		if(buf == NULL && posix_memalign((void**)&buf, max(job->dev->lbsz, 4096), job->chunk) != 0) { fail("memfail"); }
+		for(pos = off; copy_next_run(job, &pos, &run, off + len); pos += run) {
+			seekread(job->dev, job->src + pos, buf + (pos - off), run);
+		}
+
+		pthread_mutex_lock(&job->lock);
+		copy_mark(job, i, 1);
+		copy_wait_source(job, i);
+		pthread_mutex_unlock(&job->lock);
+
+		for(pos = off; copy_next_run(job, &pos, &run, off + len); pos += run) {
+			seekwrite(job->dev, job->dst + pos, buf + (pos - off), run);
+			copied += run;
+		}
+
+		pthread_mutex_lock(&job->lock);
+		copy_mark(job, i, 2);
+		job->done += len;
+		job->copied += copied;
+	}
+	job->running--;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+	free(buf);
+	return NULL;
+}
+
+// the newest intact checkpoint in the journal, or none (seq 0) if there isn't one
+void journal_load(int fd, copy_ckpt* ckpt) {
+	copy_ckpt slot;
 
-	// write backup first, then primary
-	seekwrite(dev->fd, (dev->alt.ptable_lba * dev->lbsz) + (b * dev->alt.entry_size), &(part->e), PART_SZ);
-	seekwrite_zero(dev->fd, (dev->alt.ptable_lba * dev->lbsz) + (a * dev->alt.entry_size), PART_SZ);
-	seekwrite(dev->fd, dev->last_lba * dev->lbsz, &(dev->alt), HDR_SZ);
+	memset(ckpt, 0, sizeof(copy_ckpt));
+	for(int i = 0; i < 2; i++) {
+		if(pread(fd, &slot, sizeof(slot), i * CKPT_SLOT) != sizeof(slot)) { continue; }
+		if(memcmp(slot.magic, CKPT_MAGIC, 8) != 0) { continue; }
+		if(crc32(0, &slot, offsetof(copy_ckpt, crc)) != slot.crc) { continue; }
+		if(slot.seq > ckpt->seq) { *ckpt = slot; }
+	}
+}
+
+// alternate slots, only ever overwriting the older one
+void journal_save(int fd, copy_ckpt* ckpt, uint64_t done) {
+	ckpt->seq++;
+	ckpt->done = done;
+	ckpt->crc = crc32(0, ckpt, offsetof(copy_ckpt, crc));
+	if(pwrite(fd, ckpt, sizeof(copy_ckpt), (ckpt->seq % 2) * CKPT_SLOT) != sizeof(copy_ckpt) || fdatasync(fd) != 0) {
+		perror("");
+		fail("could not write journal!");
+	}
+}
+
+// the map goes in before the first checkpoint that refers to it
+void journal_save_map(int fd, copy_ckpt* ckpt, alloc_map* map) {
+	uint64_t bytes = (map->units + 7) / 8;
+	uint64_t done = 0;
+	ssize_t r;
+
+	ckpt->map_base = map->base;
+	ckpt->map_unit = map->unit;
+	ckpt->map_units = map->units;
+	ckpt->map_crc = crc32(0, map->bits, bytes);
+	while(done < bytes) {
+		if((r = pwrite(fd, map->bits + done, bytes - done, 2 * CKPT_SLOT + done)) <= 0) { perror(""); fail("could not write journal!"); }
+		done += r;
+	}
+	if(fdatasync(fd) != 0) { perror(""); fail("could not write journal!"); }
+}
+
+alloc_map* journal_load_map(int fd, copy_ckpt* ckpt) {
+	uint64_t bytes = (ckpt->map_units + 7) / 8;
+	alloc_map* map;
+	ssize_t r;
+
+	if((map = calloc(1, sizeof(alloc_map))) == NULL) { fail("memfail"); }
+	if((map->bits = malloc(bytes)) == NULL) { fail("memfail"); }
+	map->base = ckpt->map_base;
+	map->unit = ckpt->map_unit;
+	map->units = ckpt->map_units;
+	if((r = pread(fd, map->bits, bytes, 2 * CKPT_SLOT)) < 0 || (uint64_t)r != bytes || crc32(0, map->bits, bytes) != ckpt->map_crc) {
+		fail("journal allocation map is damaged!");
+	}
+	return map;
+}
+
+alloc_map* copy_alloc_map(gpt_dev* dev, uint64_t src) {
+	alloc_map* map = alloc_map_read(dev, src * dev->lbsz);
+	if(map == NULL) {
+		warn("no filesystem with a known allocation map at block %lu, copying all of it", src);
+	}
+	return map;
+}
+
+// everything written so far goes to the device, and only then is it recorded
+// call with the lock held, it is dropped while syncing
+void copy_checkpoint(copy_job* job, int fd) {
+	uint64_t done = job->written_prefix;
+
+	job->want_ckpt = 0;
+	if(done == job->durable) { return; }
+	pthread_mutex_unlock(&job->lock);
+	if(fdatasync(job->dev->fd) != 0) { perror(""); fail("could not sync copied data!"); }
+	journal_save(fd, &job->ckpt, done);
+	pthread_mutex_lock(&job->lock);
+	job->durable = done;
+	pthread_cond_broadcast(&job->cond);
+}
+
+// copy count blocks of data from block src to block dst, the ranges may overlap
+void copy_data(gpt_dev* dev, uint64_t src, uint64_t dst, uint64_t count) {
+	copy_job job = { .dev = dev, .lock = PTHREAD_MUTEX_INITIALIZER };
+	pthread_t workers[COPY_WORKERS];
+	pthread_condattr_t attr;
+	struct timespec started;
+	struct timespec deadline;
+	uint64_t dist;
+	uint64_t resumed = 0;
+	double secs;
+	int jfd = -1;
+	int n;
+
+	if(count == 0) { fail("nothing to copy!"); }
+	if(src > dev->last_lba || dst > dev->last_lba || count > dev->last_lba + 1 - max(src, dst)) {
+		fail("copy does not fit on the device!");
+	}
+	if(src == dst) { return; }
+
+	job.src = src * dev->lbsz;
+	job.dst = dst * dev->lbsz;
+	job.len = count * dev->lbsz;
+	dist = src > dst ? job.src - job.dst : job.dst - job.src;
+	job.chunk = COPY_CHUNK;
+	// a chunk that overlaps its own destination can't be redone after an interruption
+	if(dev->journal && dist < job.chunk) {
+		job.chunk = dist;
+	}
+	job.chunks = (job.len + job.chunk - 1) / job.chunk;
+	// moving up over itself has to start at the top
+	job.backward = dst > src && dist < job.len;
+	job.lag = dist < job.len ? dist / job.chunk : job.chunks;
+	// the kernel copies straight from the fd, so only for the plain backend, and never within one chunk
+	job.use_cfr = dev->io == &io_backends[0] && job.lag > 0;
+	if((job.state = calloc(job.chunks, 1)) == NULL) { fail("memfail"); }
+
+	if(dev->journal) {
+		if((jfd = open(dev->journal, O_RDWR | O_CREAT, 0600)) == -1) { perror(""); fail("could not open journal %s!", dev->journal); }
+		journal_load(jfd, &job.ckpt);
+		if(job.ckpt.seq) {
+			if(job.ckpt.src != src || job.ckpt.dst != dst || job.ckpt.count != count || job.ckpt.lbsz != dev->lbsz ||
+				job.ckpt.chunk != job.chunk || memcmp(job.ckpt.disk_guid, dev->hdr.disk_guid, 16) != 0 || job.ckpt.done > job.chunks) {
+				fail("journal %s is for a different copy!", dev->journal);
+			}
+			resumed = job.ckpt.done;
+			if(job.ckpt.map_units) {
+				job.map = journal_load_map(jfd, &job.ckpt);
+			}
+		} else {
+			memcpy(job.ckpt.magic, CKPT_MAGIC, 8);
+			job.ckpt.src = src;
+			job.ckpt.dst = dst;
+			job.ckpt.count = count;
+			job.ckpt.lbsz = dev->lbsz;
+			job.ckpt.chunk = job.chunk;
+			memcpy(job.ckpt.disk_guid, dev->hdr.disk_guid, 16);
+			if(dev->alloc_only && (job.map = copy_alloc_map(dev, src)) != NULL) {
+				journal_save_map(jfd, &job.ckpt, job.map);
+			}
+			journal_save(jfd, &job.ckpt, 0);
+		}
+		job.journal = 1;
+		memset(job.state, 2, resumed);
+		job.next = job.read_prefix = job.written_prefix = job.durable = resumed;
+		job.done = min(resumed * job.chunk, job.len);
+		if(resumed) {
+			fprintf(stderr, "resuming copy after %lu of %lu chunks\n", resumed, job.chunks);
+		}
+	} else if(dev->alloc_only) {
+		job.map = copy_alloc_map(dev, src);
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&job.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	deadline = started;
+	n = min(job.chunks - resumed, COPY_WORKERS);
+	job.running = n;
+	for(int i = 0; i < n; i++) {
+		if(pthread_create(&workers[i], NULL, copy_worker, &job) != 0) { fail("could not start copy worker!"); }
+	}
+
+	// checkpoints happen with each report, or sooner if a worker can't go on without one
+	pthread_mutex_lock(&job.lock);
+	deadline.tv_sec += COPY_REPORT;
+	while(job.running) {
+		if(job.want_ckpt) {
+			copy_checkpoint(&job, jfd);
+		} else if(pthread_cond_timedwait(&job.cond, &job.lock, &deadline) == ETIMEDOUT) {
+			if(job.journal) {
+				copy_checkpoint(&job, jfd);
+			}
+			secs = elapsed(&started);
+			fprintf(stderr, "done %lu of %lu MiB, %.1f MiB/s\n", job.done >> 20, job.len >> 20, (job.copied >> 20) / secs);
+			deadline.tv_sec += COPY_REPORT;
+		}
+	}
+	pthread_mutex_unlock(&job.lock);
+	for(int i = 0; i < n; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	// like dd conv=fsync, the copy isn't done until it is on the device
+	if(fdatasync(dev->fd) != 0) { perror(""); fail("could not sync copied data!"); }
+	if(jfd != -1) {
+		close(jfd);
+		unlink(dev->journal);
+	}
+	secs = elapsed(&started);
+	fprintf(stderr, "copied %lu blocks from %lu to %lu, %.1f MiB in %.1f seconds, %.1f MiB/s\n",
+		count, src, dst, job.copied / 1048576.0, secs, (job.copied / 1048576.0) / max(secs, 1e-9));
+	if(job.map) {
+		fprintf(stderr, "skipped %.1f MiB the filesystem does not use\n", (job.done - job.copied - min(resumed * job.chunk, job.len)) / 1048576.0);
+		free(job.map->bits);
+		free(job.map);
+	}
 
-	seekwrite(dev->fd, (dev->hdr.ptable_lba * dev->lbsz) + (b * dev->hdr.entry_size), &(part->e), PART_SZ);
-	seekwrite_zero(dev->fd, (dev->hdr.ptable_lba * dev->lbsz) + (a * dev->hdr.entry_size), PART_SZ);
-	seekwrite(dev->fd, 1 * dev->lbsz,             &(dev->hdr), HDR_SZ);
+	pthread_cond_destroy(&job.cond);
+	free(job.state);
+}
 
-	fprintf(stderr, "moved partition entry %u to %u\n", a+1, b+1);
+int parse_format(char* name) {
+	if(strcmp(name, "text") == 0) { return FORMAT_TEXT; }
+	if(strcmp(name, "json") == 0) { return FORMAT_JSON; }
+	if(strcmp(name, "bin") == 0) { return FORMAT_BIN; }
+	fail("unknown format %s!", name);
 }
 
 void usage() {
 	wprintf(L""
-		"%s [-h]\n"
+		"%s [-h] [-T SECS] [-F FORMAT] [-I IO] [-K DIR] [-W SECS]\n"
 		"%s [DEVICE] [COMMANDS]\n"
 		"\n"
 		"Print or modify contents of GPT partition tables.\n"
 		"\n"
 		"If no DEVICE is provided all known devices are printed.\n"
+		"Devices are probed concurrently, any taking longer than SECS(-T, default 10, 0 waits forever) are skipped.\n"
+		"With -W all disks are watched instead: each is validated once, and again whenever the kernel reports it\n"
+		"added or changed, printing an event (add, change, reset for a new disk sequence number, remove) only when\n"
+		"its table status or headers differ. Every SECS (0 never) one disk is scrubbed, reading both tables in full.\n"
+		"A disk that does not answer within the -T timeout keeps its last event until the next time it is probed.\n"
 		"COMMANDS are processed in the order given. Will print if none provided.\n"
 		"\n"
 		"WARNING: This is a raw editing tool primarily to be used by scripts.\n"
@@ -1289,8 +4245,17 @@ void usage() {
 		"-R H P     Use custom header and part entry sizing when building a GPT table (-g).\n"
 		"           92<=H<=lbsz. P must be a power of 2 and >=128. The extra space must be zero.\n"
 		"           This option has almost no practical use and is generally not recommended to use.\n"
+		"-I IO      Device I/O backend: pread (default), mmap (map the whole image, can't grow it),\n"
+		"           mem (writes are held in memory and discarded at exit, for dry runs and tests),\n"
+		"           direct (O_DIRECT whole blocks, bypasses the page cache where allowed),\n"
+		"           or uring (io_uring, batched reads, ordered writes with a flush before the primary).\n"
+		"-K DIR     Keep validated tables in DIR (for example /run/gpt) and trust them while the disk sequence\n"
+		"           number and both headers are unchanged, so an unchanged disk costs one header read.\n"
+		"           Block devices only, give it before anything that reads the table.\n"
 		"\n"
 		"-p         Print disk information, the mbr table, and the gpt table.\n"
+		"-F FORMAT  Print (-p, all devices, or -W events) as text (default), json (one object per line),\n"
+		"           or bin (fixed 160 byte little endian records, see rec in gpt.c).\n"
 		"-b         Build and write a new protective MBR\n"
 		"-g         Build and write new blank GPT table (wipes all partitions!)\n"
 		"-r         Relabel an existing table with -U UUID, or a new random one if not provided.\n"
@@ -1303,6 +4268,7 @@ void usage() {
 		"           START and END are in blocks and are both inclusive.\n"
 		"           Defaults to a free range for a given START or END, or first available.\n"
 		"           TYPEID defaults to 0fc63daf-8483-4772-8e79-3d69d8477de4 (linux-generic).\n"
+		"           TYPEID may also be any alias from gpt.ids (esp, swap, home, ...), which is built in.\n"
 		"           Bits in attr fields '-' skip over existing flags. '+' toggles existing flag.\n"
 		"           LABEL defaults to null. LABEL may be any UTF string representable in UTF-16.\n"
 		"           (Though you might want to avoid '/' for path compatibility)\n"
@@ -1310,12 +4276,33 @@ void usage() {
 		"           Alternative set(-s). A '-' can be used to skip all fields but label.\n"
 		"-d NUM     Delete a partition entry (set all its contents to zero).\n"
 		"-m A B     Renumber (move) partition A to number B. B should not exist.\n"
+		"-E NUM START END\n"
+		"           Relocate partition NUM to blocks START-END (inclusive), keeping its number, ids, attributes and label.\n"
+		"           A '-' START keeps the start (resize), a '-' END keeps the size (shift).\n"
+		"           Fails without writing anything if the new range overlaps another partition or the tables.\n"
+		"           Only the table entry changes, move the data first (-D) when shifting.\n"
+		"-D SRC DST COUNT\n"
+		"           Copy COUNT blocks of data from block SRC to block DST, the ranges may overlap.\n"
+		"           Several chunks are in flight at once, the copy is synced before returning,\n"
+		"           and throughput is reported on stderr. Does not touch the partition table.\n"
+		"-A         Following copies (-D) only move what the filesystem at SRC uses, for ext2/3/4, FAT32, and NTFS.\n"
+		"           Anything else is copied whole. The filesystem must not be mounted.\n"
+		"-J FILE    Checkpoint following copies (-D) in FILE, which should not be on the device being copied.\n"
+		"           A copy that finds a checkpoint for the same copy resumes from it instead of starting over.\n"
+		"           Only data already synced to the device is ever recorded, FILE is removed when the copy completes.\n"
+		"\n"
+		"-S         Stage the following edits (-b -r -s -x -d -m -E) in memory instead of writing each one.\n"
+		"           Ranges are checked, CRCs calculated, and everything written once on -C or after the last COMMAND.\n"
+		"           Nothing is written if any command fails. -g -f -l can't be used while staging.\n"
+		"-C         Commit staged edits (backup table first, then primary) and stop staging.\n"
 		"\n"
 		, program_name, program_name);
 }
 
 int main(int argc, char* argv[]) {
 	int cmd_processed = 0;
+	// -B wins over the size -L would work out
+	int last_lba_set = 0;
 	gpt_dev dev = {0};
 
 	uint64_t num;
@@ -1342,6 +4329,9 @@ int main(int argc, char* argv[]) {
 		if(open_device(argv[0], &dev, O_RDWR) != 0) { fail("could not open device!"); }
 		argv++;
 	} else {
+		unsigned int timeout = SCAN_TIMEOUT;
+		int scrub = -1;
+
 		// no device provided. only handle print options
 		while(argv[0] != NULL && argv[0][0] == '-') {
 			while(argv[0][1] != '\0') {
@@ -1349,6 +4339,31 @@ int main(int argc, char* argv[]) {
 					case 'h':
 						usage();
 						return 0;
+					case 'T':
+						if(argv[1] == NULL) { fail("need argument!"); }
+						timeout = atoi(argv[1]);
+						argv += 1;
+						goto next_printopt;
+					case 'F':
+						if(argv[1] == NULL) { fail("need argument!"); }
+						out_format = parse_format(argv[1]);
+						argv += 1;
+						goto next_printopt;
+					case 'I':
+						if(argv[1] == NULL) { fail("need argument!"); }
+						io_default = io_find(argv[1]);
+						argv += 1;
+						goto next_printopt;
+					case 'K':
+						if(argv[1] == NULL) { fail("need argument!"); }
+						cache_dir = argv[1];
+						argv += 1;
+						goto next_printopt;
+					case 'W':
+						if(argv[1] == NULL) { fail("need argument!"); }
+						scrub = atoi(argv[1]);
+						argv += 1;
+						goto next_printopt;
 					default:
 						usage();
 						return 1;
@@ -1359,7 +4374,11 @@ next_printopt:
 			argv++;
 		}
 
-		print_devices();
+		if(scrub >= 0) {
+			watch_devices(scrub, timeout);
+		} else if(print_devices(timeout) != 0) {
+			return EXIT_FAILURE;
+		}
 		return 0;
 	}
 
@@ -1371,8 +4390,17 @@ next_printopt:
 					return 0;
 				case 'L':
 					if(argv[1] == NULL) { fail("need argument!"); }
-					dev.lbsz = atoi(argv[1]);
+					num = strtoul(argv[1], NULL, 10);
+					if(num < 512 || num > UINT32_MAX || (num & (num - 1)) != 0) { fail("logical block size must be a power of two, at least 512!"); }
+					// same device size in the new block size
+					if(!last_lba_set) {
+						dev.last_lba = ((dev.last_lba + 1) * dev.lbsz) / num - 1;
+						dev.max_size_digits = digits(dev.last_lba);
+					}
+					dev.lbsz = num;
 					warn("overriding logical block size to %u", dev.lbsz);
+					// headers were read at the old block size
+					read_headers(&dev);
 					argv += 1;
 					goto next_cmd;
 				case 'G':
@@ -1386,7 +4414,9 @@ next_printopt:
 					if(argv[1] == NULL) { fail("need argument!"); }
 					dev.last_lba = strtol(argv[1], NULL, 10);
 					dev.max_size_digits = digits(dev.last_lba);
+					last_lba_set = 1;
 					warn("overriding last lba to %lu", dev.last_lba);
+					read_headers(&dev);
 					argv += 1;
 					goto next_cmd;
 				case 'N':
@@ -1415,6 +4445,30 @@ next_printopt:
 					if(dev.part_sz < 128 || ((dev.part_sz & dev.part_sz - 1) != 0)) { fail("invalid part size!"); }
 					argv += 2;
 					goto next_cmd;
+				case 'F':
+					if(argv[1] == NULL) { fail("need argument!"); }
+					out_format = parse_format(argv[1]);
+					argv += 1;
+					goto next_cmd;
+				case 'I':
+					if(argv[1] == NULL) { fail("need argument!"); }
+					io_use(&dev, io_find(argv[1]));
+					// so nothing read through the old backend lingers
+					read_headers(&dev);
+					argv += 1;
+					goto next_cmd;
+				case 'K':
+					if(argv[1] == NULL) { fail("need argument!"); }
+					cache_dir = argv[1];
+					argv += 1;
+					goto next_cmd;
+				case 'S':
+					dev.staging = 1;
+					break;
+				case 'C':
+					cmd_processed = 1;
+					commit_staged(&dev);
+					break;
 				case 'p':
 					cmd_processed = 1;
 					print_device(&dev);
@@ -1425,6 +4479,7 @@ next_printopt:
 					break;
 				case 'g':
 					cmd_processed = 1;
+					ensure_unstaged(&dev);
 					write_gpt(&dev);
 					break;
 				case 'r':
@@ -1433,10 +4488,12 @@ next_printopt:
 					break;
 				case 'f':
 					cmd_processed = 1;
+					ensure_unstaged(&dev);
 					restore_primary(&dev);
 					break;
 				case 'l':
 					cmd_processed = 1;
+					ensure_unstaged(&dev);
 					restore_backup(&dev);
 					break;
 				case 's':
@@ -1501,6 +4558,26 @@ next_printopt:
 					move_entry(&dev, strtol(argv[1], NULL, 10), strtol(argv[2], NULL, 10));
 					argv += 2;
 					goto next_cmd;
+				case 'A':
+					dev.alloc_only = 1;
+					break;
+				case 'J':
+					if(argv[1] == NULL) { fail("need argument!"); }
+					dev.journal = argv[1];
+					argv += 1;
+					goto next_cmd;
+				case 'E':
+					if(argv[1] == NULL || argv[2] == NULL || argv[3] == NULL) { fail("need arguments!"); }
+					cmd_processed = 1;
+					relocate_entry(&dev, strtol(argv[1], NULL, 10), argv[2], argv[3]);
+					argv += 3;
+					goto next_cmd;
+				case 'D':
+					if(argv[1] == NULL || argv[2] == NULL || argv[3] == NULL) { fail("need arguments!"); }
+					cmd_processed = 1;
+					copy_data(&dev, strtoull(argv[1], NULL, 10), strtoull(argv[2], NULL, 10), strtoull(argv[3], NULL, 10));
+					argv += 3;
+					goto next_cmd;
 				default:
 					usage();
 					return 1;
@@ -1511,6 +4588,10 @@ next_cmd:
 		argv++;
 	}
 
+	if(dev.staging) {
+		commit_staged(&dev);
+	}
+
 	if(!cmd_processed) {
 		validate_device(&dev);
 		print_device(&dev);
@@ -0,0 +1,74 @@
+#!/bin/sh
+# SPDX-License-Identifier: MIT-0
+# gpt_ids.sh
+# Copyright (C) 2025 Casey Fitzpatrick <kcghost@gmail.com>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+# Generate the C type alias tables gpt.c is built with from gpt.ids
+# gpt_ids.sh <gpt.ids> > gpt_ids.h
+set -e
+
+export LC_ALL=C
+
+fail() {
+	echo "${1}" >&2
+	exit 1
+}
+
+[ -r "${1}" ] || fail "usage: gpt_ids.sh <gpt.ids>"
+
+# "<on-disk bytes in hex> <alias> <line>" for every alias, GUIDs keep their mixed endian layout
+entries=$(awk '
+	/^#/ || NF < 2 { next }
+	# no regex intervals, not every awk has them
+	length($2) != 36 || $2 !~ /^[0-9a-f-]*$/ || substr($2, 9, 1) substr($2, 14, 1) substr($2, 19, 1) substr($2, 24, 1) != "----" {
+		printf "gpt.ids:%u: bad uuid %s\n", NR, $2 > "/dev/stderr"
+		exit 1
+	}
+	{
+		u = $2
+		key = substr(u, 7, 2) substr(u, 5, 2) substr(u, 3, 2) substr(u, 1, 2) \
+			substr(u, 12, 2) substr(u, 10, 2) \
+			substr(u, 17, 2) substr(u, 15, 2) \
+			substr(u, 20, 4) substr(u, 25, 12)
+		print key, $1, NR
+	}
+' "${1}")
+
+dups=$(echo "${entries}" | awk '{ print $2 }' | sort | uniq -d)
+[ -z "${dups}" ] || fail "gpt.ids: duplicate alias ${dups}"
+
+# "<bytes> <alias> <line>" lines to C initializers
+entries_c='{
+	printf "\t{ { "
+	for(i = 1; i <= 32; i += 2) {
+		printf "0x%s%s", substr($1, i, 2), (i < 31 ? ", " : "")
+	}
+	printf " }, \"%s\" },\n", $2
+}'
+
+echo "// generated from gpt.ids by gpt_ids.sh, edit gpt.ids instead"
+echo ""
+echo "// every type GUID once, named by the first alias listed for it, in memcmp order"
+echo "static const type_alias type_by_guid[] = {"
+echo "${entries}" | sort -k1,1 -k3,3n | awk '$1 != last { print; last = $1 }' | awk "${entries_c}"
+echo "};"
+echo ""
+echo "// every alias, in strcmp order"
+echo "static const type_alias type_by_name[] = {"
+echo "${entries}" | sort -k2,2 | awk "${entries_c}"
+echo "};"
@@ -30,6 +30,23 @@ ded() {
 
 trap 'onerr' EXIT
 
+# type, attributes, PARTUUID and label of a partition, everything but its range
+part_entry() {
+	sudo ./gpt /dev/loop0 | awk -F'|' -v n="${1}" '$1 == "p" && $2 + 0 == n' | cut -d'|' -f5-
+}
+
+# start and end block of a partition
+part_range() {
+	sudo ./gpt /dev/loop0 | awk -F'|' -v n="${1}" '$1 == "p" && $2 + 0 == n { print $3 + 0, $4 + 0 }'
+}
+
+expect_entry() {
+	if [ "$(part_entry "${1}")" != "${2}" ]; then
+		echo "partition ${1} lost its type, flags or PARTUUID"
+		exit 1
+	fi
+}
+
 make_disk() {
 	echo "creating test disk and setting up loop device..."
 	dd if=/dev/zero bs=1MiB count=1024 of="test.disk"
@@ -73,12 +90,71 @@ test_holes() {
 	ded -y create loop0 ext4 8 MiB
 	ded -y remove loop0 2
 	ded -y remove loop0 5
-	# add some strange flags to test recreating them
+	# strange flags that have to survive the table edits
 	sudo parted /dev/loop0 set 3 hidden on
 	sudo parted /dev/loop0 set 3 hp-service on
+	entry=$(part_entry 3)
+	[ -n "${entry}" ]
 	ded -y lshift loop0 3
-	# new partition is 2
-	ded -y resize loop0 2
+	expect_entry 3 "${entry}"
+	ded -y resize loop0 3
+	expect_entry 3 "${entry}"
+}
+
+# fill an ext4 partition with random files, then free some so the used blocks have gaps
+fill_part() {
+	mkdir -p test.mnt
+	sudo mount "${1}" test.mnt
+	i=0
+	while sudo dd if=/dev/urandom of="test.mnt/fill.${i}" bs=1MiB count=4 2>/dev/null; do
+		i=$(( i + 1 ))
+	done
+	sudo rm -f test.mnt/fill.*[05]
+	(cd test.mnt && sha256sum fill.*) > test.sums
+	sudo umount test.mnt
+}
+
+check_part() {
+	sudo e2fsck -fn "${1}"
+	sudo mount -o ro "${1}" test.mnt
+	(cd test.mnt && sha256sum -c --quiet ../test.sums)
+	sudo umount test.mnt
+}
+
+# a full filesystem shifted over its own start
+test_lshift_data() {
+	ded -y wipe loop0
+	ded -y create loop0 ext4 8 MiB
+	ded -y create loop0 ext4 128 MiB
+	fill_part /dev/loop0p2
+	ded -y remove loop0 1
+	ded -y lshift loop0 2
+	check_part /dev/loop0p2
+}
+
+# the same copy killed partway, then run again to resume from its journal
+test_lshift_resume() {
+	# a copy that finishes before the kill can't be resumed, so start over and give it less time
+	for t in 0.05 0.1 0.2 0.5 1 2; do
+		ded -y wipe loop0
+		ded -y create loop0 ext4 8 MiB
+		ded -y create loop0 ext4 128 MiB
+		fill_part /dev/loop0p2
+		set -- $(part_range 1) $(part_range 2)
+		ded -y remove loop0 1
+		sudo rm -f test.journal
+		sudo timeout -s KILL "${t}" ./gpt /dev/loop0 -A -J test.journal -D "${3}" "${1}" $(( ${4} - ${3} + 1 )) || true
+		if [ -e test.journal ]; then
+			sudo ./gpt /dev/loop0 -A -J test.journal -D "${3}" "${1}" $(( ${4} - ${3} + 1 ))
+			[ ! -e test.journal ]
+			sudo ./gpt /dev/loop0 -E 2 "${1}" -
+			sudo partprobe /dev/loop0
+			check_part /dev/loop0p2
+			return
+		fi
+	done
+	echo "could not interrupt the copy"
+	exit 1
 }
 
 test_resize() {
@@ -113,6 +189,8 @@ main() {
 	test_argparsing
 	test_fs
 	test_holes
+	test_lshift_data
+	test_lshift_resume
 	test_resize
 
 	sudo parted -s /dev/loop0 unit B print free